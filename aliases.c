@@ -138,7 +138,7 @@ void mk_aliases(mnt_t *m, whatalias_t fsspec)
 	alist_t *a;
 	char path[PATH_MAX], *mpnt;
 	
-	mpnt = mkpath(path, m->dir);
+	mpnt = mkpath(path, m->root, m->dir);
 	for(a = m->aliases; a; a = a->next) {
 		unsigned u_cnt = 0;
 		int have_uniq;
@@ -194,7 +194,7 @@ void rm_aliases(mnt_t *m, whatalias_t fsspec)
 int has_alias(mnt_t *m, const char *name)
 {
 	alist_t *a;
-	unsigned preflen = strlen(autodir)+1;
+	unsigned preflen = strlen(m->root->dir)+1;
 
 	for(a = m->aliases; a; a = a->next) {
 		if (a->created && streq(a->created+preflen, name))
@@ -230,12 +230,31 @@ void mnt_add_alias(mnt_t *m, const char *a, unsigned flags)
 	debug("added alias %s to %s", a, m->dev);
 }
 
+/* remove a single alias, e.g. a permanent one whose fstab entry is gone */
+void mnt_rm_alias(mnt_t *m, const char *name)
+{
+	alist_t **a = &m->aliases;
+
+	while(*a) {
+		if (streq((*a)->name, name)) {
+			alist_t *p = *a;
+			*a = p->next;
+
+			rm_alias(m, p);
+			free((char*)(p->name));
+			free(p);
+		}
+		else
+			a = &(*a)->next;
+	}
+}
+
 void mnt_free_aliases(mnt_t *m, unsigned mask, unsigned flags)
 {
 	alist_t **a = &m->aliases;
 	char path[PATH_MAX];
 
-	mkpath(path, m->dir);
+	mkpath(path, m->root, m->dir);
 
 	while(*a) {
 		if (((*a)->flags & mask) == flags) {
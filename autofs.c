@@ -18,9 +18,11 @@
  * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307  USA.
  *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <alloca.h>
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
@@ -30,21 +32,53 @@
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <dirent.h>
+#include <mntent.h>
 #include <linux/types.h>
 #include <linux/kd.h>
+#include <linux/magic.h>
 #include <linux/auto_fs4.h>
+#include <linux/auto_dev-ioctl.h>
 #include <linux/version.h>
 #include "mediad.h"
 
+#define AUTOFS_CTL_DEV		"/dev/autofs"
+
+typedef struct _adopted {
+	struct _adopted *next;
+	dev_t           devno;		/* st_dev of the mounted filesystem */
+	char            *source;	/* device it was mounted from */
+	char            name[];
+} adopted_t;
+
+typedef struct _rootopt {
+	struct _rootopt *next;
+	mcond_t        *cond;
+	unsigned       prio;
+	const char     *dir;
+	unsigned long  timeout;
+	unsigned       workers;
+} rootopt_t;
+
+typedef struct _rootpkt {
+	struct _rootpkt *next;
+	autoroot_t     *root;
+	union autofs_v5_packet_union pkt;
+} rootpkt_t;
+
 
 const char *autodir = "/media";
+autoroot_t *default_root = NULL;
 
+static autoroot_t *roots = NULL;
+static pthread_mutex_t roots_lock = PTHREAD_MUTEX_INITIALIZER;
+static rootopt_t *rootopts = NULL;
+static pthread_mutex_t rootopts_lock = PTHREAD_MUTEX_INITIALIZER;
 static int n_mounted = 0;
-static pthread_mutex_t expire_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t expire_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t blink_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t blinker_thread = 0;
-static int pfd, ifd;
 
 
 static int toggle_led(int fd, int led)
@@ -113,48 +147,51 @@ static void *blinker(void *dummy)
 }
 
 
-void inc_mounted(void)
+void inc_mounted(autoroot_t *r)
 {
-	pthread_mutex_lock(&expire_lock);
-	n_mounted++;
-	pthread_cond_signal(&expire_cond);
+	pthread_mutex_lock(&r->lock);
+	r->n_mounted++;
+	pthread_cond_signal(&r->expire_cond);
+	pthread_mutex_unlock(&r->lock);
 
-	if (config.blink_led && n_mounted == 1) {
-		pthread_mutex_lock(&blink_lock);
-		if (!blinker_thread) {
-			if (pthread_create(&blinker_thread, &thread_detached,
-							   blinker, NULL))
-				warning("failed to create blinker thread");
-		}
-		pthread_mutex_unlock(&blink_lock);
+	pthread_mutex_lock(&blink_lock);
+	if (++n_mounted == 1 && config.blink_led && !blinker_thread) {
+		if (pthread_create(&blinker_thread, &thread_detached,
+						   blinker, NULL))
+			warning("failed to create blinker thread");
 	}
-	pthread_mutex_unlock(&expire_lock);
+	pthread_mutex_unlock(&blink_lock);
 	
-	debug("n_mounted=%d", n_mounted);
+	debug("n_mounted=%d (%d in %s)", n_mounted, r->n_mounted, r->dir);
 }
 
-void dec_mounted(void)
+void dec_mounted(autoroot_t *r)
 {
-	pthread_mutex_lock(&expire_lock);
+	pthread_mutex_lock(&r->lock);
+	--r->n_mounted;
+	pthread_mutex_unlock(&r->lock);
+	pthread_mutex_lock(&blink_lock);
 	--n_mounted;
-	pthread_mutex_unlock(&expire_lock);
-	debug("n_mounted=%d", n_mounted);
+	pthread_mutex_unlock(&blink_lock);
+	debug("n_mounted=%d (%d in %s)", n_mounted, r->n_mounted, r->dir);
 }
 
-static void *expire_automounts(void *dummy)
+static void *expire_automounts(void *_root)
 {
+	autoroot_t *r = (autoroot_t*)_root;
+
 	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
 	
 	while(!shutting_down) {
-		pthread_mutex_lock(&expire_lock);
-		while(n_mounted == 0) {
-			pthread_cond_wait(&expire_cond, &expire_lock);
+		pthread_mutex_lock(&r->lock);
+		while(r->n_mounted == 0) {
+			pthread_cond_wait(&r->expire_cond, &r->lock);
 		}
-		pthread_mutex_unlock(&expire_lock);
+		pthread_mutex_unlock(&r->lock);
 
-		while(n_mounted > 0) {
+		while(r->n_mounted > 0) {
 			int now = AUTOFS_EXP_LEAVES;
-			while(ioctl(ifd, AUTOFS_IOC_EXPIRE_MULTI, &now) == 0)
+			while(ioctl(r->ifd, AUTOFS_IOC_EXPIRE_MULTI, &now) == 0)
 				;
 			usleep(config.expire_freq*1000000);
 		}
@@ -162,11 +199,11 @@ static void *expire_automounts(void *dummy)
 	return NULL;
 }
 
-static int send_ack(unsigned int wait_queue_token, int failed)
+static int send_ack(autoroot_t *r, unsigned int wait_queue_token, int failed)
 {
 	if (!wait_queue_token)
 		return 0;
-	if (ioctl(ifd, failed ? AUTOFS_IOC_FAIL : AUTOFS_IOC_READY,
+	if (ioctl(r->ifd, failed ? AUTOFS_IOC_FAIL : AUTOFS_IOC_READY,
 			  wait_queue_token) < 0) {
 		warning("AUTOFS_IOC_xxx: %s", strerror(errno));
 		return -1;
@@ -174,32 +211,64 @@ static int send_ack(unsigned int wait_queue_token, int failed)
 	return 0;
 }
 
-static void *handle_missing(void *_pkt)
+static void run_pending(autoroot_t *r);
+
+/* reserve up to n worker slots of r for background work that isn't
+ * requested by the kernel; returns how many were free */
+unsigned take_workers(autoroot_t *r, unsigned n)
+{
+	pthread_mutex_lock(&r->lock);
+	if (r->max_workers && r->n_workers + n > r->max_workers)
+		n = r->n_workers >= r->max_workers ? 0 :
+			r->max_workers - r->n_workers;
+	r->n_workers += n;
+	pthread_mutex_unlock(&r->lock);
+	return n;
+}
+
+/* a handler thread is done, give its slot back to the root's budget */
+void put_worker(autoroot_t *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->n_workers--;
+	pthread_mutex_unlock(&r->lock);
+	run_pending(r);
+}
+
+static void *handle_missing(void *_rpkt)
 {
-	struct autofs_packet_missing *pkt = (struct autofs_packet_missing*)_pkt;
+	rootpkt_t *rpkt = (rootpkt_t*)_rpkt;
+	struct autofs_packet_missing *pkt =
+		(struct autofs_packet_missing*)&rpkt->pkt;
+	autoroot_t *r = rpkt->root;
 	char name[pkt->len+1];
 
 	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
 	
 	strncpy(name, pkt->name, pkt->len);
 	name[pkt->len] = '\0';
-	debug("request for %s", name);
-	send_ack(pkt->wait_queue_token, do_mount(name));
-	free(pkt);
+	debug("request for %s/%s", r->dir, name);
+	send_ack(r, pkt->wait_queue_token, do_mount(r, name));
+	free(rpkt);
+	put_worker(r);
 	return NULL;
 }
 
-static void *handle_expire(void *_pkt)
+static void *handle_expire(void *_rpkt)
 {
-	struct autofs_packet_expire_multi *pkt = (struct autofs_packet_expire_multi*)_pkt;
+	rootpkt_t *rpkt = (rootpkt_t*)_rpkt;
+	struct autofs_packet_expire_multi *pkt =
+		(struct autofs_packet_expire_multi*)&rpkt->pkt;
+	autoroot_t *r = rpkt->root;
 	char name[pkt->len+1];
 
 	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
 	
 	strncpy(name, pkt->name, pkt->len);
 	name[pkt->len] = '\0';
-	send_ack(pkt->wait_queue_token, do_umount(name));
-	free(pkt);
+	send_ack(r, pkt->wait_queue_token, do_umount(r, name));
+	free(rpkt);
+	put_worker(r);
 	return NULL;
 }
 
@@ -273,42 +342,354 @@ static int read_kernel_packet(int fd, union autofs_v5_packet_union *pkt)
 	return 0;
 }
 
-static void *handle_autofs_events(void *dummy)
+/* start a handler thread for rpkt, which already has a worker slot */
+static void start_handler(rootpkt_t *rpkt)
 {
-	union autofs_v5_packet_union pkt, *pktp;
+	autoroot_t *r = rpkt->root;
+	int missing = rpkt->pkt.hdr.type == autofs_ptype_missing;
+	pthread_t newthread;
+
+	if (pthread_create(&newthread, &thread_detached,
+					   missing ? handle_missing : handle_expire, rpkt)) {
+		warning("failed to create %s thread", missing ? "mount" : "umount");
+		send_ack(r, ((struct autofs_packet_missing*)&rpkt->pkt)->wait_queue_token, 1);
+		free(rpkt);
+		put_worker(r);
+	}
+}
+
+/* start handlers for queued requests as far as the budget allows */
+static void run_pending(autoroot_t *r)
+{
+	rootpkt_t *rpkt;
+
+	for(;;) {
+		pthread_mutex_lock(&r->lock);
+		if (!(rpkt = r->pending) ||
+			(r->max_workers && r->n_workers >= r->max_workers)) {
+			pthread_mutex_unlock(&r->lock);
+			return;
+		}
+		if (!(r->pending = rpkt->next))
+			r->pending_tail = &r->pending;
+		r->n_workers++;
+		pthread_mutex_unlock(&r->lock);
+		start_handler(rpkt);
+	}
+}
+
+static void *handle_autofs_events(void *_root)
+{
+	autoroot_t *r = (autoroot_t*)_root;
+	union autofs_v5_packet_union pkt;
+	rootpkt_t *rpkt;
 
 	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
 	
 	while(!shutting_down) {
-		pthread_t newthread;
-
-		if (read_kernel_packet(pfd, &pkt) < 0)
+		if (read_kernel_packet(r->pfd, &pkt) < 0)
 			return NULL;
 
-		switch(pkt.hdr.type) {
-		  case autofs_ptype_missing:
-			pktp = xmalloc(sizeof(union autofs_v5_packet_union));
-			*pktp = pkt;
-			if (pthread_create(&newthread, &thread_detached,
-							   handle_missing, pktp))
-				warning("failed to create mount thread");
-			break;
-		  case autofs_ptype_expire_multi:
-			pktp = xmalloc(sizeof(union autofs_v5_packet_union));
-			*pktp = pkt;
-			if (pthread_create(&newthread, &thread_detached,
-							   handle_expire, pktp))
-				warning("failed to create umount thread");
-			break;
-		  default:
+		if (pkt.hdr.type != autofs_ptype_missing &&
+			pkt.hdr.type != autofs_ptype_expire_multi) {
 			warning("unknown autofs packet type %d from kernel",
 					pkt.hdr.type);
+			continue;
 		}
+		rpkt = xmalloc(sizeof(rootpkt_t));
+		rpkt->next = NULL;
+		rpkt->root = r;
+		rpkt->pkt = pkt;
+
+		if (pkt.hdr.type == autofs_ptype_expire_multi) {
+			/* never held back: the kernel waits for the answer, and
+			 * unmounting frees resources */
+			pthread_mutex_lock(&r->lock);
+			r->n_workers++;
+			pthread_mutex_unlock(&r->lock);
+			start_handler(rpkt);
+			continue;
+		}
+		/* if this root's worker budget is used up, queue the lookup until a
+		 * handler finishes; the reader goes on, and other roots have their
+		 * own budget anyway */
+		pthread_mutex_lock(&r->lock);
+		*r->pending_tail = rpkt;
+		r->pending_tail = &rpkt->next;
+		pthread_mutex_unlock(&r->lock);
+		run_pending(r);
 	}
 	return NULL;
 }
 
-void start_automount(const char *dir)
+void add_rootopt(mcond_t *cond, const char *dir,
+				 unsigned long timeout, unsigned workers)
+{
+	rootopt_t *o = xmalloc(sizeof(rootopt_t)), **oo;
+
+	o->cond = cond;
+	o->prio = mcond_prio(cond);
+	o->dir = xstrdup(dir);
+	o->timeout = timeout;
+	o->workers = workers;
+
+	pthread_mutex_lock(&rootopts_lock);
+	/* keep sorted by prio, append at end within same level */
+	for(oo = &rootopts; *oo; oo = &(*oo)->next)
+		if ((*oo)->prio > o->prio)
+			break;
+	o->next = *oo;
+	*oo = o;
+	pthread_mutex_unlock(&rootopts_lock);
+}
+
+void purge_rootopts(void)
+{
+	rootopt_t *o;
+
+	pthread_mutex_lock(&rootopts_lock);
+	while((o = rootopts)) {
+		rootopts = o->next;
+		free_mcond(o->cond);
+		free((char*)o->dir);
+		free(o);
+	}
+	pthread_mutex_unlock(&rootopts_lock);
+}
+
+/* settings for a root: first value given in any of its root statements,
+ * global settings otherwise */
+static void root_settings(autoroot_t *r)
+{
+	rootopt_t *o;
+	unsigned long timeout = 0;
+	unsigned workers = 0;
+
+	pthread_mutex_lock(&rootopts_lock);
+	for(o = rootopts; o; o = o->next) {
+		if (!streq(o->dir, r->dir))
+			continue;
+		if (!timeout)
+			timeout = o->timeout;
+		if (!workers)
+			workers = o->workers;
+	}
+	pthread_mutex_unlock(&rootopts_lock);
+
+	r->expire_timeout = timeout ? timeout : config.expire_timeout;
+	r->max_workers = workers ? workers : config.max_workers;
+}
+
+static int autofs_ctl(int ctlfd, int cmd, struct autofs_dev_ioctl *param)
+{
+	if (ioctl(ctlfd, cmd, param) < 0) {
+		warning("%s: ioctl 0x%x: %s", AUTOFS_CTL_DEV, cmd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Reconnect to an autofs left behind by a previous daemon instance (see
+ * detach_automount()). Returns an ioctl fd on the mount root, or -1 if there
+ * is no such mount or it cannot be taken over. */
+static int reopen_automount(const char *dir, int pipe_wr)
+{
+	struct statfs sfs;
+	struct stat st;
+	struct autofs_dev_ioctl *param;
+	size_t psize = AUTOFS_DEV_IOCTL_SIZE+strlen(dir)+1;
+	int ctlfd, mfd = -1;
+
+	if (statfs(dir, &sfs) || sfs.f_type != AUTOFS_SUPER_MAGIC ||
+		stat(dir, &st))
+		return -1;
+
+	if ((ctlfd = open(AUTOFS_CTL_DEV, O_RDONLY)) < 0) {
+		warning("%s: %s", AUTOFS_CTL_DEV, strerror(errno));
+		return -1;
+	}
+	param = alloca(psize);
+	init_autofs_dev_ioctl(param);
+	param->size = psize;
+	param->openmount.devid = st.st_dev;
+	strcpy(param->path, dir);
+	if (autofs_ctl(ctlfd, AUTOFS_DEV_IOCTL_OPENMOUNT, param))
+		goto out;
+	mfd = param->ioctlfd;
+
+	/* the pipe can only be replaced on a catatonic mount; if the old daemon
+	 * died without cleaning up, the kernel may not have noticed yet */
+	init_autofs_dev_ioctl(param);
+	param->ioctlfd = mfd;
+	if (autofs_ctl(ctlfd, AUTOFS_DEV_IOCTL_CATATONIC, param))
+		goto fail;
+	init_autofs_dev_ioctl(param);
+	param->ioctlfd = mfd;
+	param->setpipefd.pipefd = pipe_wr;
+	if (autofs_ctl(ctlfd, AUTOFS_DEV_IOCTL_SETPIPEFD, param))
+		goto fail;
+	goto out;
+
+  fail:
+	close(mfd);
+	mfd = -1;
+  out:
+	close(ctlfd);
+	return mfd;
+}
+
+/* the device a filesystem is mounted from, as /proc/self/mounts tells */
+static char *mount_source(const char *path)
+{
+	FILE *f;
+	struct mntent *me;
+	char *src = NULL;
+
+	if (!(f = setmntent("/proc/self/mounts", "r")))
+		return NULL;
+	while((me = getmntent(f))) {
+		/* the last one wins, it's on top */
+		if (streq(me->mnt_dir, path)) {
+			free(src);
+			src = xstrdup(me->mnt_fsname);
+		}
+	}
+	endmntent(f);
+	return src;
+}
+
+/* Clean up what the previous instance left in an adopted autofs: aliases and
+ * empty directories are removed, they'll be recreated by coldplugging,
+ * except for those listed in its state snapshot. Directories with something
+ * mounted on them are remembered, so that add_mount() can take them over. */
+static void sweep_automount(autoroot_t *r)
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat rst, st;
+	char path[PATH_MAX];
+
+	if (stat(r->dir, &rst) || !(d = opendir(r->dir)))
+		return;
+	while((de = readdir(d))) {
+		if (streq(de->d_name, ".") || streq(de->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", r->dir, de->d_name);
+		if (lstat(path, &st))
+			continue;
+		if (S_ISLNK(st.st_mode)) {
+			if (!state_keeps(path))
+				unlink(path);
+		}
+		else if (S_ISDIR(st.st_mode) && st.st_dev != rst.st_dev) {
+			adopted_t *a = xmalloc(sizeof(adopted_t)+strlen(de->d_name)+1);
+			strcpy(a->name, de->d_name);
+			a->devno = st.st_dev;
+			a->source = mount_source(path);
+			a->next = r->adopted;
+			r->adopted = a;
+			debug("found mounted %s from previous instance", path);
+		}
+		else if (S_ISDIR(st.st_mode) && !state_keeps(path)) {
+			/* may still contain partNN links */
+			DIR *sd;
+			struct dirent *sde;
+			if ((sd = opendir(path))) {
+				while((sde = readdir(sd))) {
+					if (strprefix(sde->d_name, "part") &&
+						fstatat(dirfd(sd), sde->d_name, &st,
+								AT_SYMLINK_NOFOLLOW) == 0 &&
+						S_ISLNK(st.st_mode))
+						unlinkat(dirfd(sd), sde->d_name, 0);
+				}
+				closedir(sd);
+			}
+			rmdir(path);
+		}
+	}
+	closedir(d);
+}
+
+/* unmount a left-over filesystem; a->name stays as directory */
+static void detach_adopted(autoroot_t *r, adopted_t *a)
+{
+	char path[PATH_MAX];
+
+	mkpath(path, r, a->name);
+	if (umount2(path, MNT_DETACH))
+		warning("umount(%s): %s", path, strerror(errno));
+	else
+		rm_mtab(path);
+	debug("released stale mount %s", path);
+}
+
+static void free_adopted(adopted_t *a)
+{
+	free(a->source);
+	free(a);
+}
+
+/* does the left-over mount a belong to device dev? */
+static int adopted_from(adopted_t *a, const char *dev)
+{
+	struct stat st;
+
+	if (a->source && streq(a->source, dev))
+		return 1;
+	/* the source name may be an alias, e.g. by-uuid link */
+	return !stat(dev, &st) && S_ISBLK(st.st_mode) && st.st_rdev == a->devno;
+}
+
+/* Called when a device directory is (re-)created; returns 1 if something from
+ * a previous instance is still mounted there, which then belongs to m. A
+ * mount of another device under the same name is stale and is detached. */
+int claim_adopted(autoroot_t *r, const char *name, const char *dev)
+{
+	adopted_t *a, **aa;
+	int rv = 0;
+
+	pthread_mutex_lock(&r->lock);
+	for(aa = &r->adopted; (a = *aa); aa = &a->next) {
+		if (streq(a->name, name)) {
+			*aa = a->next;
+			if (adopted_from(a, dev))
+				rv = 1;
+			else {
+				warning("%s/%s: left-over mount of %s, not of %s", r->dir,
+						name, a->source ? a->source : "another device", dev);
+				detach_adopted(r, a);
+			}
+			free_adopted(a);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+	return rv;
+}
+
+/* Mounts nobody claimed during coldplug belong to devices that went away
+ * while no daemon was running. */
+void release_adopted(void)
+{
+	autoroot_t *r;
+	adopted_t *a;
+	char path[PATH_MAX];
+
+	for(r = roots; r; r = r->next) {
+		pthread_mutex_lock(&r->lock);
+		while((a = r->adopted)) {
+			r->adopted = a->next;
+			detach_adopted(r, a);
+			mkpath(path, r, a->name);
+			if (rmdir(path))
+				warning("rmdir(%s): %s", path, strerror(errno));
+			free_adopted(a);
+		}
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+static int mount_root(autoroot_t *r)
 {
 	int pipefd[2];
 	char options[64];
@@ -316,67 +697,227 @@ void start_automount(const char *dir)
 	int kproto_major;
 	pthread_t expire_thread;
 	pthread_t handler_thread;
+	const char *dir = r->dir;
 	
-	debug("mouting autofs for %s", dir);
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		error("mkdir(%s): %s", dir, strerror(errno));
+		return -1;
+	}
 	/* create a pipe for communication with kernel */
-	if (pipe(pipefd) < 0)
-		fatal("pipe: %s", strerror(errno));
-	/* new mount a new autofs on our directory */
-	sprintf(options, "fd=%d,pgrp=%d,minproto=4,maxproto=4",
-			pipefd[1], getpgrp());
-	sprintf(mountname, "mediad(pid%d)", getpid());
-	add_mtab(mountname, dir, "autofs", options);
-	if (mount(mountname, dir, "autofs", 0, options) < 0)
-		fatal("mount(%s,%s): %s", mountname, dir, strerror(errno));
+	if (pipe(pipefd) < 0) {
+		error("pipe: %s", strerror(errno));
+		return -1;
+	}
+	if ((r->ifd = reopen_automount(dir, pipefd[1])) >= 0) {
+		msg("reconnected to existing autofs on %s", dir);
+		sweep_automount(r);
+	}
+	else {
+		debug("mouting autofs for %s", dir);
+		/* new mount a new autofs on our directory */
+		sprintf(options, "fd=%d,pgrp=%d,minproto=4,maxproto=4",
+				pipefd[1], getpgrp());
+		sprintf(mountname, "mediad(pid%d)", getpid());
+		add_mtab(mountname, dir, "autofs", options);
+		if (mount(mountname, dir, "autofs", 0, options) < 0) {
+			error("mount(%s,%s): %s", mountname, dir, strerror(errno));
+			goto err_pipe;
+		}
+
+		/* fd on root dir for ioctls */
+		if ((r->ifd = open(dir, O_RDONLY)) < 0) {
+			error("%s: %s", dir, strerror(errno));
+			goto err_umount;
+		}
+	}
 	close(pipefd[1]);
-	pfd = pipefd[0];
+	r->pfd = pipefd[0];
 	
-	/* fd on root dir for ioctls */
-	if ((ifd = open(dir, O_RDONLY)) < 0) {
-		umount(dir);
-		fatal("%s: %s", dir, strerror(errno));
-	}
-	if (ioctl(ifd, AUTOFS_IOC_PROTOVER, &kproto_major)) {
-		umount(dir);
-		fatal("AUTOFS_IOC_PROTOVER: %s", strerror(errno));
-	}
-	if (kproto_major < 4)
-		fatal("kernel autofs protocol too old (< 4.x)");
-#if 0
-	if (kproto_major == 4) {
-		if (ioctl(ifd, AUTOFS_IOC_PROTOSUBVER, &kproto_minor) ||
-			kproto_minor < 1) {
-			umount(dir);
-			fatal("kernel autofs protocol too old (4.%d < 4.1)", kproto_minor);
-		}
+	if (ioctl(r->ifd, AUTOFS_IOC_PROTOVER, &kproto_major)) {
+		error("AUTOFS_IOC_PROTOVER: %s", strerror(errno));
+		goto err_fds;
 	}
-#endif
-	if (kproto_major > AUTOFS_MAX_PROTO_VERSION)
-		fatal("kernel autofs protocol too new (%d > %d)",
+	if (kproto_major < 4) {
+		error("kernel autofs protocol too old (< 4.x)");
+		goto err_fds;
+	}
+	if (kproto_major > AUTOFS_MAX_PROTO_VERSION) {
+		error("kernel autofs protocol too new (%d > %d)",
 			  kproto_major, AUTOFS_MAX_PROTO_VERSION);
-    if (ioctl(ifd, AUTOFS_IOC_SETTIMEOUT, &config.expire_timeout)) {
-		umount(dir);
-		fatal("AUTOFS_IOC_SETTIMEOUT: %s", strerror(errno));
+		goto err_fds;
+	}
+	if (ioctl(r->ifd, AUTOFS_IOC_SETTIMEOUT, &r->expire_timeout)) {
+		error("AUTOFS_IOC_SETTIMEOUT: %s", strerror(errno));
+		goto err_fds;
 	}		
 
 	if (pthread_create(&expire_thread, &thread_detached,
-					   expire_automounts, NULL))
+					   expire_automounts, r))
 		fatal("failed to create expire thread");
 	if (pthread_create(&handler_thread, &thread_detached,
-					   handle_autofs_events, NULL))
+					   handle_autofs_events, r))
 		fatal("failed to create autofs handler thread");
+	return 0;
+
+  err_fds:
+	close(r->ifd);
+	close(r->pfd);
+	umount(dir);
+	rm_mtab(dir);
+	return -1;
+  err_umount:
+	umount(dir);
+  err_pipe:
+	rm_mtab(dir);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return -1;
+}
+
+/* find root for dir, mounting it if it isn't active yet */
+static autoroot_t *get_root(const char *dir)
+{
+	autoroot_t *r;
+
+	pthread_mutex_lock(&roots_lock);
+	for(r = roots; r; r = r->next) {
+		if (streq(r->dir, dir))
+			goto out;
+	}
+	r = xmalloc(sizeof(autoroot_t));
+	memset(r, 0, sizeof(autoroot_t));
+	r->dir = xstrdup(dir);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->expire_cond, NULL);
+	r->pending_tail = &r->pending;
+	root_settings(r);
+	if (mount_root(r)) {
+		free((char*)r->dir);
+		free(r);
+		r = NULL;
+		goto out;
+	}
+	r->next = roots;
+	roots = r;
+	debug("automount root %s active (timeout %lus, workers %u)",
+		  r->dir, r->expire_timeout, r->max_workers);
+  out:
+	pthread_mutex_unlock(&roots_lock);
+	return r;
+}
+
+/* select the automount root for a new device */
+autoroot_t *find_root(mnt_t *m)
+{
+	rootopt_t *o;
+	autoroot_t *r;
+	char *dir = NULL;
+
+	pthread_mutex_lock(&rootopts_lock);
+	for(o = rootopts; o; o = o->next) {
+		if (match_mcond(o->cond, m, NULL)) {
+			dir = strdupa(o->dir);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rootopts_lock);
+
+	if (!dir || !(r = get_root(dir)))
+		r = default_root;
+	return r;
+}
+
+/* find the active root containing path; *rest is set to the part below it */
+autoroot_t *root_of_path(const char *path, const char **rest)
+{
+	autoroot_t *r;
+	const char *p;
+
+	pthread_mutex_lock(&roots_lock);
+	for(r = roots; r; r = r->next) {
+		if ((p = strprefix(path, r->dir)) && *p == '/') {
+			*rest = p+1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&roots_lock);
+	return r;
+}
+
+/* config has been (re-)read: activate newly configured roots and pass changed
+ * timeouts on to the kernel */
+void update_roots(void)
+{
+	autoroot_t *r;
+	rootopt_t *o;
+	unsigned long old_timeout;
+	unsigned n, i;
+	const char **dirs;
+
+	if (!default_root)
+		return;
+
+	pthread_mutex_lock(&roots_lock);
+	for(r = roots; r; r = r->next) {
+		old_timeout = r->expire_timeout;
+		pthread_mutex_lock(&r->lock);
+		root_settings(r);
+		pthread_mutex_unlock(&r->lock);
+		/* the budget may have grown */
+		run_pending(r);
+		if (r->expire_timeout != old_timeout &&
+			ioctl(r->ifd, AUTOFS_IOC_SETTIMEOUT, &r->expire_timeout))
+			warning("AUTOFS_IOC_SETTIMEOUT(%s): %s", r->dir, strerror(errno));
+	}
+	pthread_mutex_unlock(&roots_lock);
+
+	pthread_mutex_lock(&rootopts_lock);
+	for(n = 0, o = rootopts; o; o = o->next)
+		++n;
+	dirs = alloca(n*sizeof(char*));
+	for(i = 0, o = rootopts; o; o = o->next)
+		dirs[i++] = strdupa(o->dir);
+	pthread_mutex_unlock(&rootopts_lock);
+	for(i = 0; i < n; ++i)
+		get_root(dirs[i]);
+}
+
+void start_automount(void)
+{
+	if (!(default_root = get_root(autodir)))
+		fatal("cannot set up automounter on %s", autodir);
+	update_roots();
 }
 
 void prepare_stop_automount(void)
 {
-	ioctl(ifd, AUTOFS_IOC_CATATONIC, 0);
+	autoroot_t *r;
+
+	for(r = roots; r; r = r->next)
+		ioctl(r->ifd, AUTOFS_IOC_CATATONIC, 0);
 }
 
-void stop_automount(const char *dir)
+/* leave the (catatonic) autofs and everything mounted below it alone, so
+ * that the next instance can pick it up again */
+void detach_automount(void)
 {
-	close(ifd);
-	close(pfd);
-	if (umount(dir))
-		error("umount(%s): %s", dir, strerror(errno));
-	rm_mtab(dir);
+	autoroot_t *r;
+
+	for(r = roots; r; r = r->next) {
+		close(r->ifd);
+		close(r->pfd);
+	}
+}
+
+void stop_automount(void)
+{
+	autoroot_t *r;
+
+	for(r = roots; r; r = r->next) {
+		close(r->ifd);
+		close(r->pfd);
+		if (umount(r->dir))
+			error("umount(%s): %s", r->dir, strerror(errno));
+		rm_mtab(r->dir);
+	}
 }
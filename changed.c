@@ -24,8 +24,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <scsi/sg.h>
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include "mediad.h"
@@ -36,16 +39,6 @@ int no_medium_errno(void)
 		   errno == ENODEV || errno == EIO;
 }
 
-int check_medium(const char *dev)
-{
-	int fd;
-
-	if ((fd = open(dev, O_RDONLY)) < 0)
-		return !no_medium_errno();
-	close(fd);
-	return 1;
-}
-
 
 /* The kernel checks for media changes and notices them reliably but,
  * unfortunately, the results of these checks are easily visible from
@@ -53,11 +46,148 @@ int check_medium(const char *dev)
  * Only for CD-ROMs, there's a dedicated ioctl for this purpose. For (PC)
  * floppies, the status data contain a generation counter that's incremented
  * for each disk change, which is not as direct but works fine, too.
- * However, I haven't found a good method for SCSI disks :( On the other hand,
- * those devices are usually sufficiently fast so that running vol_id too
- * often doesn't hurt that much.
+ * For SCSI disks (which includes most USB card readers), a TEST UNIT READY
+ * reports a UNIT ATTENTION after a medium change. That's not perfectly
+ * reliable, as the kernel's own media polling or any opener of the disk may
+ * have consumed the attention before us, so a TUR without it is
+ * cross-checked against the disk's diskseq and size.
+ *
+ * Newer kernels (5.15+) make all this unnecessary if they poll the device
+ * for media events: they count medium changes in the disk's diskseq, so
+ * comparing that with the value at the last probe is enough.
  */
 
+#define SYS_EVENTS_DFL_POLL	"/sys/module/block/parameters/events_dfl_poll_msecs"
+
+/* does the kernel watch for medium changes on this disk by itself? */
+static int kernel_polls_media(mnt_t *m)
+{
+	char path[PATH_MAX], events[64];
+	long long msecs;
+
+	snprintf(path, sizeof(path), "/sys%s/events", m->devpath);
+	if (read_sysfs_str(path, events, sizeof(events)) ||
+		!strstr(events, "media_change"))
+		return 0;
+	snprintf(path, sizeof(path), "/sys%s/events_poll_msecs", m->devpath);
+	if (read_sysfs_num(path, &msecs))
+		return 0;
+	if (msecs == -1 && read_sysfs_num(SYS_EVENTS_DFL_POLL, &msecs))
+		return 0;
+	return msecs > 0;
+}
+
+/* remember the current diskseq of a disk, if the kernel has one and keeps it
+ * up to date; the size is recorded, too, for check_changed_sysfs() */
+void record_diskseq(mnt_t *m)
+{
+	char path[PATH_MAX];
+
+	m->diskseq_polled = 0;
+	m->diskseq = m->size = -1;
+	if (!m->devpath || m->parent)
+		return;
+	snprintf(path, sizeof(path), "/sys%s/size", m->devpath);
+	read_sysfs_num(path, &m->size);
+	snprintf(path, sizeof(path), "/sys%s/diskseq", m->devpath);
+	if (read_sysfs_num(path, &m->diskseq))
+		return;
+	m->diskseq_polled = kernel_polls_media(m);
+	debug("%s: diskseq %lld%s", m->dev, m->diskseq,
+		  m->diskseq_polled ? "" : " (not polled, ignored)");
+}
+
+/* apply a configured poll-interval to the kernel's media event polling of a
+ * disk; the original value is restored by restore_media_polling() */
+void set_media_polling(mnt_t *m)
+{
+	char path[PATH_MAX];
+	long long old;
+	long msecs;
+
+	if (!m->devpath || m->parent)
+		return;
+	/* a previous instance may have changed it already */
+	if (!m->poll_msecs_set && !state_saved_poll(m, &m->saved_poll_msecs))
+		m->poll_msecs_set = 1;
+	if (find_pollopt(m, &msecs)) {
+		/* the option may have been removed from the config */
+		restore_media_polling(m);
+		return;
+	}
+	snprintf(path, sizeof(path), "/sys%s/events_poll_msecs", m->devpath);
+	if (read_sysfs_num(path, &old))
+		return;
+	if (old == msecs)
+		return;
+	if (write_sysfs_num(path, msecs)) {
+		warning("%s: cannot set media poll interval: %s",
+				m->dev, strerror(errno));
+		return;
+	}
+	debug("%s: media poll interval %lld -> %ld ms", m->dev, old, msecs);
+	/* keep the original one when the interval is changed again */
+	if (!m->poll_msecs_set) {
+		m->saved_poll_msecs = old;
+		m->poll_msecs_set = 1;
+	}
+	state_changed();
+}
+
+void restore_media_polling(mnt_t *m)
+{
+	char path[PATH_MAX];
+
+	if (!m->poll_msecs_set)
+		return;
+	m->poll_msecs_set = 0;
+	snprintf(path, sizeof(path), "/sys%s/events_poll_msecs", m->devpath);
+	/* device may be gone already, ignore errors */
+	if (!write_sysfs_num(path, m->saved_poll_msecs))
+		debug("%s: media poll interval restored to %lld ms",
+			  m->dev, m->saved_poll_msecs);
+}
+
+/* 1 = changed, 0 = unchanged, -1 = can't tell */
+static int check_changed_diskseq(mnt_t *m)
+{
+	char path[PATH_MAX];
+	long long seq;
+
+	snprintf(path, sizeof(path), "/sys%s/diskseq", m->devpath);
+	if (read_sysfs_num(path, &seq))
+		return -1;
+	if (seq == m->diskseq)
+		return 0;
+	debug("%s: diskseq %lld -> %lld", m->dev, m->diskseq, seq);
+	m->diskseq = seq;
+	return 1;
+}
+
+/* The sd driver checks for media events when the disk is opened, and that
+ * consumes the UNIT ATTENTION a later TEST UNIT READY would see. The kernel
+ * then revalidates the disk, though, so the change shows in its diskseq or
+ * size. 1 = changed, 0 = no sign of a change */
+static int check_changed_sysfs(mnt_t *m)
+{
+	char path[PATH_MAX];
+	long long val;
+
+	if (!m->devpath)
+		return 0;
+	snprintf(path, sizeof(path), "/sys%s/diskseq", m->devpath);
+	if (m->diskseq >= 0 && !read_sysfs_num(path, &val) && val != m->diskseq) {
+		debug("%s: diskseq %lld -> %lld", m->dev, m->diskseq, val);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "/sys%s/size", m->devpath);
+	if (m->size >= 0 && !read_sysfs_num(path, &val) && val != m->size) {
+		debug("%s: size %lld -> %lld", m->dev, m->size, val);
+		return 1;
+	}
+	return 0;
+}
+
 static int check_changed_cdrom(int fd, mnt_t *m)
 {
 	return ioctl(fd, CDROM_MEDIA_CHANGED, 0);
@@ -76,11 +206,169 @@ static int check_changed_floppy(int fd, mnt_t *m)
 	return 0;
 }
 
+#define SCSI_TUR_TIMEOUT		5000	/* ms */
+#define SENSE_NOT_READY			0x02
+#define ASC_MEDIUM_NOT_PRESENT	0x3a
+
+/* returns -1 if SG_IO isn't supported, 0 if the unit is ready, 1 otherwise;
+ * *key and *asc are 0 if there's no (usable) sense data */
+static int scsi_tur(int fd, mnt_t *m, unsigned *key, unsigned *asc)
+{
+	unsigned char cdb[6] = { 0 };	/* TEST UNIT READY */
+	unsigned char sense[32];
+	sg_io_hdr_t io;
+
+	*key = *asc = 0;
+	memset(&io, 0, sizeof(io));
+	io.interface_id = 'S';
+	io.cmd_len = sizeof(cdb);
+	io.cmdp = cdb;
+	io.dxfer_direction = SG_DXFER_NONE;
+	io.mx_sb_len = sizeof(sense);
+	io.sbp = sense;
+	io.timeout = SCSI_TUR_TIMEOUT;
+	if (ioctl(fd, SG_IO, &io) < 0)
+		return -1;
+	if ((io.info & SG_INFO_OK_MASK) == SG_INFO_OK)
+		return 0;
+	if (io.sb_len_wr < 3)
+		return 1;
+
+	if ((sense[0] & 0x7f) >= 0x72) {
+		/* descriptor format */
+		*key = sense[1] & 0x0f;
+		*asc = sense[2];
+	}
+	else {
+		/* fixed format */
+		if (io.sb_len_wr < 13)
+			return 1;
+		*key = sense[2] & 0x0f;
+		*asc = sense[12];
+	}
+	debug("%s: TEST UNIT READY: sense key 0x%x, asc 0x%02x", m->dev, *key, *asc);
+	return 1;
+}
+
+static int check_changed_scsi(int fd, mnt_t *m)
+{
+	unsigned key, asc;
+	int rv;
+
+	if ((rv = scsi_tur(fd, m, &key, &asc)) <= 0)
+		return rv;
+	if (key == SENSE_NOT_READY && asc == ASC_MEDIUM_NOT_PRESENT) {
+		set_no_medium_present(m);
+		return 0;
+	}
+	/* UNIT ATTENTION/MEDIUM MAY HAVE CHANGED is what we're looking for; on
+	 * any other condition better reprobe, too */
+	return 1;
+}
+
+#define SCSI_TYPE_ROM			0x05
+
+/* open the sg node of a SCSI disk; CD-ROMs are left to the sr node, which
+ * has the CDROM ioctls */
+static int open_sg_node(mnt_t *m)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	long long type;
+	DIR *dir;
+	int fd = -1;
+
+	if (!m->devpath)
+		return -1;
+	snprintf(path, sizeof(path), "/sys%s/device/type", m->devpath);
+	if (read_sysfs_num(path, &type) || type == SCSI_TYPE_ROM)
+		return -1;
+	snprintf(path, sizeof(path), "/sys%s/device/scsi_generic", m->devpath);
+	if (!(dir = opendir(path)))
+		return -1;
+	while((de = readdir(dir))) {
+		if (strprefix(de->d_name, "sg")) {
+			snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+			fd = open(path, O_RDONLY|O_NONBLOCK);
+			break;
+		}
+	}
+	closedir(dir);
+	if (fd >= 0)
+		debug("%s: using %s for change checks", m->dev, path);
+	return fd;
+}
+
+/* The handle for change checks is opened with O_NONBLOCK, which neither
+ * fails nor spins up the drive if there's no medium. For SCSI disks the sg
+ * node is used: opening sd would consume the UNIT ATTENTION of a medium
+ * change (see check_changed_sysfs()). Only sg handles are kept for the
+ * lifetime of the mnt_t; a block device handle is closed after each check
+ * (see check_changed()). */
+static int get_ctl_fd(mnt_t *m)
+{
+	if (m->ctl_fd < 0) {
+		if ((m->ctl_fd = open_sg_node(m)) >= 0)
+			m->ctl_sg = 1;
+		else if ((m->ctl_fd = open(m->dev, O_RDONLY|O_NONBLOCK)) >= 0) {
+			m->ctl_sg = 0;
+			debug("%s: opened handle for change checks", m->dev);
+		}
+	}
+	return m->ctl_fd;
+}
+
+void close_ctl_fd(mnt_t *m)
+{
+	if (m->ctl_fd >= 0) {
+		close(m->ctl_fd);
+		m->ctl_fd = -1;
+	}
+}
+
+void eject_medium(mnt_t *m)
+{
+	int fd;
+
+	/* CDROMEJECT refuses to work if there are other openers */
+	close_ctl_fd(m);
+	if ((fd = open(m->dev, O_RDONLY|O_NONBLOCK)) < 0) {
+		warning("%s: cannot open for eject: %s", m->dev, strerror(errno));
+		return;
+	}
+	if (ioctl(fd, CDROMEJECT, 0))
+		warning("%s: eject failed: %s", m->dev, strerror(errno));
+	else
+		debug("%s: ejected", m->dev);
+	close(fd);
+}
+
+int check_medium(mnt_t *m)
+{
+	unsigned key, asc;
+	int fd, rv;
+
+	/* with a kept sg handle, ask the drive instead of opening the device */
+	if (m->ctl_fd >= 0 && m->ctl_sg &&
+		(rv = scsi_tur(m->ctl_fd, m, &key, &asc)) >= 0)
+		return !(key == SENSE_NOT_READY && asc == ASC_MEDIUM_NOT_PRESENT);
+
+	if ((fd = open(m->dev, O_RDONLY)) < 0)
+		return !no_medium_errno();
+	close(fd);
+	return 1;
+}
+
 static int check_changed(mnt_t *m)
 {
 	int fd, rv;
 
-	if ((fd = open(m->dev, O_RDONLY)) < 0) {
+	if (m->diskseq_polled && (rv = check_changed_diskseq(m)) >= 0)
+		return rv;
+
+	if (m->check_change_strategy == CCS_NONE)
+		return 1;
+	if ((fd = get_ctl_fd(m)) < 0) {
 		if (no_medium_errno())
 			set_no_medium_present(m);
 		debug("check_changed(%s): open failed: %s", m->dev, strerror(errno));
@@ -96,7 +384,13 @@ static int check_changed(mnt_t *m)
 			m->check_change_strategy = CCS_FLOPPY;
 			break;
 		}
+		if ((rv = check_changed_scsi(fd, m)) >= 0) {
+			m->check_change_strategy = CCS_SCSI;
+			break;
+		}
 		m->check_change_strategy = CCS_NONE;
+		/* nothing to ask the drive, don't keep it open */
+		close_ctl_fd(m);
 		/* fall through */
 		
 	  case CCS_NONE:
@@ -111,19 +405,28 @@ static int check_changed(mnt_t *m)
 	  case CCS_FLOPPY:
 		rv = check_changed_floppy(fd, m);
 		break;
+
+	  case CCS_SCSI:
+		rv = check_changed_scsi(fd, m);
+		break;
 	}
-	close(fd);
 	if (rv < 0)
 		rv = 1;
-
+	if (m->check_change_strategy == CCS_SCSI && !rv)
+		/* any opener of sd, not only we, may have consumed the UNIT
+		 * ATTENTION */
+		rv = check_changed_sysfs(m);
+	/* sd keeps the door of removable devices locked while open, and sr
+	 * makes CDROMEJECT and door unlocks of everybody else fail */
+	if (!m->ctl_sg)
+		close_ctl_fd(m);
 	return rv;
 }
 
-static void remake_fsspec_aliases(mnt_t *m)
+static void update_fsspec_aliases(mnt_t *m)
 {
 	mark_aliases(m, AF_FSSPEC, AF_FSSPEC, AF_OLD);
 
-	get_dev_infos(m);
 	if (m->type) {
 		mnt_add_label_alias(m, AF_OLD);
 		mnt_add_uuid_alias(m, AF_OLD);
@@ -132,6 +435,44 @@ static void remake_fsspec_aliases(mnt_t *m)
 	
 	mk_aliases(m, WAT_FSSPEC);
 	mnt_free_aliases(m, AF_OLD, AF_OLD);
+	index_fs_ids(m);
+}
+
+/* first access to a device added with lazy-probe: do what add_mount()
+ * skipped */
+void finish_lazy_probe(mnt_t *m)
+{
+	mnt_t *mm = m->parent;
+	int present;
+
+	m->lazy_probe = 0;
+	debug("%s: probing on first access", m->dev);
+	if (mm) {
+		pthread_mutex_lock(&mm->lock);
+		if (mm->lazy_probe)
+			finish_lazy_probe(mm);
+		present = mm->medium_present;
+		pthread_mutex_unlock(&mm->lock);
+	}
+	else {
+		if (!m->uevent_changes)
+			m->medium_present = check_medium(m);
+		present = m->medium_present;
+	}
+	if (present && !m->type)
+		get_dev_infos(m);
+	update_fsspec_aliases(m);
+	state_changed();
+}
+
+static void remake_fsspec_aliases(mnt_t *m)
+{
+	record_diskseq(m);
+	/* not through ctl_fd: the kernel revalidates a disk after a medium
+	 * change only on open, so an old handle could still see the previous
+	 * medium */
+	probe_dev_infos(m, -1);
+	update_fsspec_aliases(m);
 }
 
 void check_medium_change(mnt_t *m)
@@ -148,8 +489,12 @@ void check_medium_change(mnt_t *m)
 		pthread_mutex_lock(&mm->lock);
 	}
 	
-	if (!mm->medium_present) {
-		if ((mm->medium_present = check_medium(mm->dev))) {
+	if (mm->uevent_changes) {
+		/* apply_change_event() keeps the state up to date */
+		debug("%s: medium state known from change events", mm->dev);
+	}
+	else if (!mm->medium_present) {
+		if ((mm->medium_present = check_medium(mm))) {
 			debug("%s: medium now present, assuming changed", mm->dev);
 			mm->medium_changed = 1;
 		}
@@ -170,6 +515,7 @@ void check_medium_change(mnt_t *m)
 	if (mm->medium_present && mm->medium_changed) {
 		remake_fsspec_aliases(mm);
 		mm->medium_changed = 0;
+		state_changed();
 	}
 
 	if (m != mm)
@@ -189,7 +535,66 @@ void set_no_medium_present(mnt_t *m)
 	mm->medium_present = 0;
 	rm_aliases(mm, WAT_FSSPEC);
 	mnt_free_aliases(mm, AF_FSSPEC, AF_FSSPEC);
+	unindex_fs_ids(mm->dev);
+	state_changed();
 
 	if (m->parent)
 		pthread_mutex_unlock(&m->parent->lock);
 }
+
+/* Take over the properties of a "change" uevent, which udev has already
+ * probed for the current medium. Once a device has sent a media change event
+ * (or the kernel polls it), the kernel notices its medium changes by itself
+ * and check_medium_change() can trust our state. Returns 1 if the filesystem
+ * is a different one now. */
+int apply_change_event(mnt_t *m, unsigned n, char **ids)
+{
+	const char *otype = m->type, *ouuid = m->uuid, *olabel = m->label;
+	unsigned i, was_present = m->medium_present;
+	int cdrom = 0, cdrom_media = 0, media_event = 0, changed;
+
+	m->type = m->uuid = m->label = NULL;
+	for(i = 0; i < n; ++i) {
+		if (streq(ids[i], "DISK_MEDIA_CHANGE=1"))
+			media_event = 1;
+		else if (strprefix(ids[i], "ID_CDROM="))
+			cdrom = 1;
+		else if (strprefix(ids[i], "ID_CDROM_MEDIA="))
+			cdrom_media = 1;
+		/* only the filesystem depends on the medium; DEVPATH must not
+		 * change without mounts_lock, m is hashed by it */
+		else if (strprefix(ids[i], "ID_FS_"))
+			parse_id(m, ids[i]);
+	}
+	if (!m->parent) {
+		if (m->type)
+			m->medium_present = 1;
+		else if (cdrom)
+			m->medium_present = cdrom_media;
+		else
+			m->medium_present = check_medium(m);
+		/* other change events (udevadm trigger, a partition table
+		 * reread, ...) don't mean the kernel reports medium changes */
+		if (media_event || kernel_polls_media(m))
+			m->uevent_changes = 1;
+		m->medium_changed = 0;
+		record_diskseq(m);
+	}
+
+	changed = was_present != m->medium_present ||
+			  !same_str(otype, m->type) || !same_str(ouuid, m->uuid) ||
+			  !same_str(olabel, m->label);
+	xfree(&otype);
+	xfree(&ouuid);
+	xfree(&olabel);
+	if (!changed) {
+		debug("%s: change event, but same medium", m->dev);
+		return 0;
+	}
+
+	debug("%s: change event, medium %s, fstype %s", m->dev,
+		  m->medium_present ? "present" : "absent",
+		  m->type ? m->type : "none");
+	update_fsspec_aliases(m);
+	return 1;
+}
@@ -162,6 +162,21 @@ static int getnum(char **p)
 	return val;
 }
 
+/* number of milliseconds, or "off" for 0 */
+static int getinterval(char **p)
+{
+	char *w, *we;
+	int val;
+
+	if (!(w = getword(p)))
+		PERRI("expected interval missing");
+	if (streq(w, "off"))
+		return 0;
+	if ((val = strtoul(w, &we, 10)) <= 0 || we == w || *we)
+		PERRIA("bad interval '%s'", w);
+	return val;
+}
+
 static int getled(char **p)
 {
 	char *w;
@@ -186,6 +201,29 @@ static int getled(char **p)
 	return val;
 }
 
+/* root "dir" [timeout=n] [workers=n] if ... */
+static int getrootopts(char **p, unsigned long *timeout, unsigned *workers)
+{
+	char *w;
+	int n;
+
+	for(;;) {
+		skipwhite(p);
+		if (!(w = getword(p)))
+			PERRI("missing 'if' or 'for'");
+		if (streq(w, "if") || streq(w, "for"))
+			return 0;
+		if (!streq(w, "timeout") && !streq(w, "workers"))
+			PERRIA("unknown root setting '%s'", w);
+		if (getassign(p) || (n = getnum(p)) < 0)
+			return -1;
+		if (streq(w, "timeout"))
+			*timeout = n;
+		else
+			*workers = n;
+	}
+}
+
 static mcond_t *getmcond(char **p)
 {
 	char *w, *value;
@@ -320,6 +358,34 @@ static void parse_line(int lno, char *line)
 		}
 		config.expire_timeout = n;
 	}
+	else if (streq(w, "startup-hold")) {
+		if (getassign(&p) || (n = getnum(&p)) < 0)
+			goto parse_err;
+		config.startup_hold = n;
+	}
+	else if (streq(w, "reconnect-grace")) {
+		if (getassign(&p) || (n = getnum(&p)) < 0)
+			goto parse_err;
+		config.reconnect_grace = n;
+	}
+	else if (streq(w, "max-workers")) {
+		if (getassign(&p) || (n = getnum(&p)) < 0)
+			goto parse_err;
+		config.max_workers = n;
+	}
+	else if (streq(w, "root")) {
+		unsigned long timeout = 0;
+		unsigned workers = 0;
+		if (!(w = getstr(&p)) || getrootopts(&p, &timeout, &workers) ||
+			!(c = getmcondlist(&p)))
+			goto parse_err;
+		if (w[0] != '/') {
+			free_mcond(c);
+			parse_error = "root directory must be an absolute path";
+			goto parse_err;
+		}
+		add_rootopt(c, w, timeout, workers);
+	}
 	else if (streq(w, "options")) {
 		if (!(w = getstr(&p)) || getif(&p) || !(c = getmcondlist(&p)))
 			goto parse_err;
@@ -335,6 +401,27 @@ static void parse_line(int lno, char *line)
 			goto parse_err;
 		add_mntoptions(c, MOPT_NO_AUTOMOUNT);
 	}
+	else if (streq(w, "premount")) {
+		if (getif(&p) || !(c = getmcondlist(&p)))
+			goto parse_err;
+		add_mntoptions(c, MOPT_PREMOUNT);
+	}
+	else if (streq(w, "mount-all-partitions")) {
+		if (getif(&p) || !(c = getmcondlist(&p)))
+			goto parse_err;
+		add_mntoptions(c, MOPT_MOUNT_SIBLINGS);
+	}
+	else if (streq(w, "lazy-probe")) {
+		if (getif(&p) || !(c = getmcondlist(&p)))
+			goto parse_err;
+		add_mntoptions(c, MOPT_LAZY_PROBE);
+	}
+	else if (streq(w, "poll-interval")) {
+		if ((n = getinterval(&p)) < 0 || getif(&p) ||
+			!(c = getmcondlist(&p)))
+			goto parse_err;
+		add_pollopt(c, n);
+	}
 	else if (streq(w, "use")) {
 		if (!(w = getstr(&p)) ||
 			!(w2 = getword(&p)) || !streq(w2, "instead") ||
@@ -367,11 +454,13 @@ static void parse_line(int lno, char *line)
 static void purge_config(void)
 {
 	config = (config_t){ DEF_AUTOFS_EXP_FREQ, DEF_AUTOFS_TIMEOUT,
-						 0, 0, 0, 0, 0, 0, 0, 0 };
+						 0, DEF_STARTUP_HOLD, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 	purge_fsoptions();
 	purge_mntoptions();
 	purge_aliases();
 	purge_fstype_replace();
+	purge_rootopts();
+	purge_pollopts();
 	if (FORCE_DEBUG)
 		config.debug = 1;
 }
@@ -408,4 +497,5 @@ void read_config(void)
 	}
 	fclose(f);
 	strpool_free();
+	update_roots();
 }
@@ -35,11 +35,12 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mount.h>
 #include <sys/mount.h>
-#include <sys/sysinfo.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/inotify.h>
 #include <netinet/in.h>
 #include <libudev.h>
 #include "mediad.h"
@@ -49,26 +50,43 @@
 #endif
 
 
-struct udev *udev;
 pthread_attr_t thread_detached;
 sigset_t termsigs;
 int volatile shutting_down = 0;
 
+typedef struct _dirkey {
+	autoroot_t *root;
+	const char *name;
+} dirkey_t;
+
 static mnt_t *mounts = NULL;
+/* removed devices waiting reconnect-grace seconds for coming back; also
+ * protected by mounts_lock */
+static mnt_t *lost_mounts = NULL;
 static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+/* mounts by devpath, so partitions find their disk quickly; also protected
+ * by mounts_lock */
+#define DEVPATH_HASH_SIZE 64
+static mnt_t *devpath_hash[DEVPATH_HASH_SIZE];
 static pthread_mutexattr_t rec_mutex;
+static int startup_done = 0;
+static pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+static struct timespec start_time;
 
 
 int has_alias(mnt_t *m, const char *name);
 
 static int by_dirname(mnt_t *m, const void *arg)
 {
-	return streq(m->dir, (const char*)arg);
+	const dirkey_t *k = (const dirkey_t*)arg;
+	return m->root == k->root && streq(m->dir, k->name);
 }
 static int by_dirname_or_alias(mnt_t *m, const void *arg)
 {
-	const char *name = (const char*)arg;
-	return (streq(m->dir, name) || has_alias(m, name));
+	const dirkey_t *k = (const dirkey_t*)arg;
+	return m->root == k->root &&
+		(streq(m->dir, k->name) || has_alias(m, k->name));
 }
 static int by_dev(mnt_t *m, const void *arg)
 {
@@ -83,6 +101,66 @@ static int by_ptr(mnt_t *m, const void *arg)
 	return m == (const mnt_t*)arg;
 }
 
+static unsigned hash_devpath(const char *devpath)
+{
+	unsigned h = 0;
+
+	while(*devpath)
+		h = h*31 + (unsigned char)*devpath++;
+	return h % DEVPATH_HASH_SIZE;
+}
+
+/* mounts_lock must be held */
+static void hash_mount(mnt_t *m)
+{
+	unsigned h;
+
+	if (m->hashed || !m->devpath)
+		return;
+	h = hash_devpath(m->devpath);
+	m->hnext = devpath_hash[h];
+	devpath_hash[h] = m;
+	m->hashed = 1;
+}
+
+/* mounts_lock must be held; m->devpath may have been replaced since
+ * hash_mount(), so don't rely on its bucket */
+static void unhash_mount(mnt_t *m)
+{
+	mnt_t **mm;
+	unsigned h;
+
+	if (!m->hashed)
+		return;
+	for(h = 0; h < DEVPATH_HASH_SIZE; ++h) {
+		for(mm = &devpath_hash[h]; *mm; mm = &(*mm)->hnext) {
+			if (*mm == m) {
+				*mm = m->hnext;
+				m->hashed = 0;
+				return;
+			}
+		}
+	}
+}
+
+static mnt_t *find_mount(int (*func)(mnt_t*, const void*), const void *arg)
+{
+	mnt_t *m;
+
+	if (func == by_devpath) {
+		for(m = devpath_hash[hash_devpath(arg)]; m; m = m->hnext) {
+			if (func(m, arg))
+				return m;
+		}
+		return NULL;
+	}
+	for(m = mounts; m; m = m->next) {
+		if (func(m, arg))
+			return m;
+	}
+	return NULL;
+}
+
 static mnt_t *get_mount(int (*func)(mnt_t*, const void*),
 						const void *arg, int retw_mounts_lock, unsigned tries)
 {
@@ -93,11 +171,7 @@ static mnt_t *get_mount(int (*func)(mnt_t*, const void*),
 	  
 		pthread_mutex_lock(&mounts_lock);
 
-		for(m = mounts; m; m = m->next) {
-			if (func(m, arg))
-				break;
-		}
-		if (!m) {
+		if (!(m = find_mount(func, arg))) {
 			if (!retw_mounts_lock)
 				pthread_mutex_unlock(&mounts_lock);
 			return NULL;
@@ -121,22 +195,189 @@ static mnt_t *get_mount(int (*func)(mnt_t*, const void*),
 	}
 }
 
-int do_mount(const char *name)
+/* Until the devices present at startup are registered, lookups of unknown
+ * names are held (up to startup-hold seconds) instead of failing right away.
+ * Returns 1 if the caller waited and should look again. */
+static int wait_startup(const char *name)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&startup_lock);
+	if (startup_done) {
+		pthread_mutex_unlock(&startup_lock);
+		return 0;
+	}
+	debug("holding lookup of %s until startup is complete", name);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += config.startup_hold;
+	while(!startup_done) {
+		if (pthread_cond_timedwait(&startup_cond, &startup_lock, &ts) ==
+			ETIMEDOUT) {
+			debug("startup-hold expired for %s", name);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&startup_lock);
+	return 1;
+}
+
+static void set_startup_done(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msg("startup complete after %ld ms",
+		(now.tv_sec-start_time.tv_sec)*1000 +
+		(now.tv_nsec-start_time.tv_nsec)/1000000);
+	pthread_mutex_lock(&startup_lock);
+	startup_done = 1;
+	pthread_cond_broadcast(&startup_cond);
+	pthread_mutex_unlock(&startup_lock);
+}
+
+static int mount_dev(autoroot_t *r, const char *name, int siblings);
+
+static void *premount(void *_key)
+{
+	dirkey_t *key = (dirkey_t*)_key;
+
+	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
+
+	debug("premounting %s/%s", key->root->dir, key->name);
+	mount_dev(key->root, key->name, 0);
+	free((char*)key->name);
+	free(key);
+	return NULL;
+}
+
+/* siblings to be mounted by a few threads within the root's worker budget */
+typedef struct {
+	autoroot_t *root;
+	pthread_mutex_t lock;
+	unsigned n, next, threads;
+	char *names[];
+} sibjob_t;
+
+static void free_sibjob(sibjob_t *job)
+{
+	unsigned i;
+
+	for(i = 0; i < job->n; ++i)
+		free(job->names[i]);
+	free(job);
+}
+
+static void *mount_sibling_worker(void *_job)
+{
+	sibjob_t *job = _job;
+	char *name;
+	int last;
+
+	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
+
+	for(;;) {
+		pthread_mutex_lock(&job->lock);
+		name = job->next < job->n ? job->names[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+		if (!name)
+			break;
+		debug("premounting sibling %s/%s", job->root->dir, name);
+		/* mount_dev() skips it if it's mounted already */
+		mount_dev(job->root, name, 0);
+	}
+	put_worker(job->root);
+
+	pthread_mutex_lock(&job->lock);
+	last = !--job->threads;
+	pthread_mutex_unlock(&job->lock);
+	if (last)
+		free_sibjob(job);
+	return NULL;
+}
+
+/* start mounting all other partitions of m's disk in the background */
+static void mount_siblings(mnt_t *m)
+{
+	mnt_t *p = m->parent ? m->parent : m, *s;
+	sibjob_t *job;
+	pthread_t newthread;
+	unsigned n, i, threads;
+
+	pthread_mutex_lock(&mounts_lock);
+	for(n = 0, s = mounts; s; s = s->next) {
+		if (s != m && s->parent == p)
+			++n;
+	}
+	job = xmalloc(sizeof(sibjob_t)+n*sizeof(char*));
+	job->root = p->root;
+	job->n = job->next = 0;
+	for(s = mounts; s && job->n < n; s = s->next) {
+		if (s != m && s->parent == p)
+			job->names[job->n++] = xstrdup(s->dir);
+	}
+	pthread_mutex_unlock(&mounts_lock);
+
+	/* it's only an optimization, so no waiting for free workers */
+	if (!(threads = take_workers(job->root, job->n))) {
+		free_sibjob(job);
+		return;
+	}
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_mutex_lock(&job->lock);
+	job->threads = threads;
+	for(i = 0; i < threads; ++i) {
+		if (pthread_create(&newthread, &thread_detached,
+						   mount_sibling_worker, job)) {
+			warning("failed to create premount thread");
+			job->threads -= threads - i;
+			while(i++ < threads)
+				put_worker(job->root);
+			break;
+		}
+	}
+	threads = job->threads;
+	pthread_mutex_unlock(&job->lock);
+	if (!threads)
+		free_sibjob(job);
+}
+
+int do_mount(autoroot_t *r, const char *name)
+{
+	return mount_dev(r, name, 1);
+}
+
+static int mount_dev(autoroot_t *r, const char *name, int siblings)
 {
 	mnt_t *m;
 	int forced_ro = 0;
 	const char *options;
-	char path[strlen(autodir)+strlen(name)+2];
-
-	if (!(m = get_mount(by_dirname, name, 0, 0)))
-		return -1;
+	char path[strlen(r->dir)+strlen(name)+2];
+	dirkey_t key = { r, name };
+
+	if (!(m = get_mount(by_dirname, &key, 0, 0))) {
+		if (!wait_startup(name))
+			return -1;
+		if (!(m = get_mount(by_dirname_or_alias, &key, 0, 0)))
+			return -1;
+		if (!streq(m->dir, name)) {
+			/* became an alias meanwhile, the kernel will follow it */
+			pthread_mutex_unlock(&m->lock);
+			return 0;
+		}
+	}
 
 	if (m->mounted) {
 		debug("%s already mounted by another thread", name);
 		pthread_mutex_unlock(&m->lock);
 		return 0;
 	}
-	check_medium_change(m);
+	if (siblings && (m->mount_siblings ||
+					 (m->parent && m->parent->mount_siblings)))
+		mount_siblings(m);
+	if (m->lazy_probe)
+		finish_lazy_probe(m);
+	else
+		check_medium_change(m);
 	if (!m->type) {
 		debug("no filesystem found on %s", m->dev);
 		pthread_mutex_unlock(&m->lock);
@@ -145,7 +386,7 @@ int do_mount(const char *name)
 
 	if (!(options = find_fsoptions(m)))
 		options = DEF_FSOPTIONS;
-	mkpath(path, name);
+	mkpath(path, r, name);
 	switch(call_mount(m->dev, path, m->type, options)) {
 	  case 0:
 		break;
@@ -177,29 +418,36 @@ int do_mount(const char *name)
 	debug("mounted %s on %s (type %s%s)",
 		  m->dev, path, m->type, forced_ro ? ", forced read-only" : "");
 	pthread_mutex_unlock(&m->lock);
-	inc_mounted();
+	inc_mounted(r);
 	return 0;
 }
 
-int do_umount(const char *name)
+/* umount_dev() results besides 0 */
+#define UMOUNT_BUSY		-1		/* still in use, or unmount failed */
+#define UMOUNT_UNKNOWN	-2		/* not one of our devices */
+#define UMOUNT_KEPT		-3		/* no_automount, isn't expired */
+
+/* force also unmounts no_automount devices, e.g. for an eject */
+static int umount_dev(autoroot_t *r, const char *name, int force)
 {
 	mnt_t *m;
 	int err;
-	char path[strlen(autodir)+strlen(name)+2];
+	char path[strlen(r->dir)+strlen(name)+2];
+	dirkey_t key = { r, name };
 
-	if (!(m = get_mount(by_dirname_or_alias, name, 0, 0)))
-		return -1;
+	if (!(m = get_mount(by_dirname_or_alias, &key, 0, 0)))
+		return UMOUNT_UNKNOWN;
 	if (!m->mounted) {
 		//debug("%s already unmounted (by another thread?)", name);
 		pthread_mutex_unlock(&m->lock);
 		return 0;
 	}
-	if (m->no_automount) {
+	if (m->no_automount && !force) {
 		pthread_mutex_unlock(&m->lock);
-		return -1;
+		return UMOUNT_KEPT;
 	}
 	
-	mkpath(path, name);
+	mkpath(path, r, name);
 	err = umount(path);
 	debug("umount %s -> %d", path, err ? errno : 0);
 
@@ -209,17 +457,22 @@ int do_umount(const char *name)
 		m->mounted = 0;
 		pthread_mutex_unlock(&m->lock);
 		rm_mtab(path);
-		dec_mounted();
+		dec_mounted(r);
 		return 0;
 	}
 	pthread_mutex_unlock(&m->lock);
-	return -1;
+	return UMOUNT_BUSY;
+}
+
+int do_umount(autoroot_t *r, const char *name)
+{
+	return umount_dev(r, name, 0);
 }
 
 
 static void add_child(mnt_t *p, mnt_t *m)
 {
-	char path[strlen(autodir)+1+strlen(p->dir)+1+7+1];
+	char path[strlen(p->root->dir)+1+strlen(p->dir)+1+7+1];
 	char linkto[3+strlen(m->dir)+1];
 
 	if (m->parent && m->parent == p)
@@ -232,7 +485,7 @@ static void add_child(mnt_t *p, mnt_t *m)
 
 	debug("setting parent of %s to %s", m->dev, p->dev);
 	snprintf(path, sizeof(path), "%s/%s/part%02d",
-			 autodir, p->dir, m->partition);
+			 p->root->dir, p->dir, m->partition);
 	strcpy(linkto, "../");
 	strcat(linkto, m->dir);
 	if (symlink(linkto, path))
@@ -244,7 +497,7 @@ static void add_child(mnt_t *p, mnt_t *m)
 
 static void rm_child(mnt_t *p, mnt_t *m)
 {
-	char path[strlen(autodir)+1+strlen(p->dir)+1+7+1];
+	char path[strlen(p->root->dir)+1+strlen(p->dir)+1+7+1];
 
 	if (m->parent != p) {
 		error("parent inconsistency (m->p=%p, p=%p)", m->parent, p);
@@ -256,7 +509,7 @@ static void rm_child(mnt_t *p, mnt_t *m)
 		p->n_children--;
 	
 	snprintf(path, sizeof(path), "%s/%s/part%02d",
-			 autodir, p->dir, m->partition);
+			 p->root->dir, p->dir, m->partition);
 	if (unlink(path))
 		/* catatonic mode used to suppress errors, but I see them
 		 * again with 4.19 ?!? */
@@ -264,45 +517,78 @@ static void rm_child(mnt_t *p, mnt_t *m)
 			error("unlink(%s): %s", path, strerror(errno));
 }
 
-static void check_parent(mnt_t *m, int show_warn)
+/* partition number from the DEVTYPE/PARTN properties of a uevent: 0 for a
+ * disk, -1 if unknown */
+static int event_partition(unsigned n, char **ids)
+{
+	unsigned i;
+	int part = -1, partn = -1;
+	const char *p;
+
+	for(i = 0; i < n; ++i) {
+		if ((p = strprefix(ids[i], "DEVTYPE=")))
+			part = streq(p, "partition");
+		else if ((p = strprefix(ids[i], "PARTN=")))
+			partn = atoi(p);
+	}
+	if (part == 0)
+		return 0;
+	return (part == 1 && partn > 0) ? partn : -1;
+}
+
+static void check_parent(mnt_t *m, int show_warn, int partn)
 {
 	mnt_t *par;
-	char *fname, *p;
-	struct stat st;
-	unsigned pnum = 0;
-	
+	const char *p;
+	long long num;
+
 	if (!m->devpath)
 		return;
-	fname = alloca(4+strlen(m->devpath)+1+5+1);
-	strcpy(fname, "/sys");
-	strcat(fname, m->devpath);
-	strcat(fname, "/start");
-	if (stat(fname, &st))
-		/* no .../start entry -> isn't a partition */
-		return;
-
-	/* cut off "/start" again */
-	*(p = fname+strlen(fname)-6) = '\0';
-	/* look for partition number */
-	while(p > fname && isdigit(p[-1]))
-		--p;
-	pnum = strtoul(p, NULL, 10);
-	/* cut off last component (partition dev name) */
-	if (!(p = strrchr(fname, '/')))
+	if (partn < 0) {
+		/* not known from the event, ask sysfs */
+		char fname[5+strlen(m->devpath)+10+1];
+		sprintf(fname, "/sys%s/partition", m->devpath);
+		partn = read_sysfs_num(fname, &num) ? 0 : num;
+	}
+	if (partn <= 0)
+		/* isn't a partition */
 		return;
-	*p = '\0';
 
-	if (!(par = get_mount(by_devpath, fname+4, 0, 6))) {
-		if (show_warn)
-			warning("parent device (devpath=%s) for %s not found!", fname+4, m->dev);
+	/* the disk is one level up in the device tree */
+	if (!(p = strrchr(m->devpath, '/')))
 		return;
+	{
+		char pdevpath[p - m->devpath + 1];
+		memcpy(pdevpath, m->devpath, p - m->devpath);
+		pdevpath[p - m->devpath] = '\0';
+		if (!(par = get_mount(by_devpath, pdevpath, 0, 6))) {
+			if (show_warn)
+				warning("parent device (devpath=%s) for %s not found!",
+						pdevpath, m->dev);
+			return;
+		}
 	}
 
-	m->partition = pnum;
+	m->partition = partn;
 	add_child(par, m);
 	pthread_mutex_unlock(&par->lock);
 }
 
+static int dir_in_use(const char *dir)
+{
+	mnt_t *m;
+
+	for(m = mounts; m; m = m->next) {
+		if (streq(m->dir, dir))
+			return 1;
+	}
+	for(m = lost_mounts; m; m = m->next) {
+		if (streq(m->dir, dir))
+			return 1;
+	}
+	return 0;
+}
+
 static const char *dev_to_dir(const char *dev)
 {
 	const char *p = dev, *pp;
@@ -337,7 +623,7 @@ static void *delayed_message(void *mnt)
 		goto out;
 	}
 	/* still exists and no children -> print message */
-	msg("new %s/%s available (no filesystem)", autodir, m->dir);
+	msg("new %s/%s available (no filesystem)", m->root->dir, m->dir);
 	if (!m->parent && m->serial)
 		lpmsg("(serial number is %s)", m->serial);
 
@@ -346,13 +632,19 @@ static void *delayed_message(void *mnt)
 	return NULL;
 }
 
-static void add_mount(const char *dev, const char *perm_alias,
+static int revive_mount(mnt_t *m);
+
+static void add_mount(const char *dev, autoroot_t *root, const char *perm_alias,
 					  unsigned n, char **ids)
 {
 	mnt_t *m;
 	unsigned i, mpres;
 	char *msgbuf;
 	unsigned options;
+	dirkey_t *premount_key = NULL;
+	int fresh = 0, revived = 0, restored = 0, lazy;
+	autoroot_t *noauto_root = NULL;
+	char *noauto_dir = NULL, *state_root = NULL;
 
 	/* check for /dev prefix, to catch bad callers that come without */
 	if (!strprefix(dev, "/dev/")) {
@@ -382,6 +674,18 @@ static void add_mount(const char *dev, const char *perm_alias,
 		pthread_mutex_lock(&m->lock);
 		m->dev = xstrdup(dev);
 		m->dir = dev_to_dir(dev);
+		m->ctl_fd = -1;
+		if (dir_in_use(m->dir)) {
+			/* a reconnected device still uses this name */
+			char *udir = xmalloc(strlen(m->dir)+12);
+			unsigned u = 1;
+			do {
+				sprintf(udir, "%s_%u", m->dir, u++);
+			} while(dir_in_use(udir));
+			free((char*)m->dir);
+			m->dir = udir;
+		}
+		fresh = 1;
 
 		m->next = mounts;
 		mounts  = m;
@@ -391,27 +695,65 @@ static void add_mount(const char *dev, const char *perm_alias,
 	for(i = 0; i < n; ++i)
 		parse_id(m, ids[i]);
 	find_devpath(m);
+	pthread_mutex_lock(&mounts_lock);
+	unhash_mount(m);
+	hash_mount(m);
+	pthread_mutex_unlock(&mounts_lock);
 	/* suppress "no parent found" warning if called with perm_alias set from
 	 * scan_fstab */
-	check_parent(m, !perm_alias);
-	if (!m->parent)
-		m->medium_present = check_medium(m->dev);
+	check_parent(m, !perm_alias, event_partition(n, ids));
+	if (fresh)
+		revived = revive_mount(m);
+	if (fresh && !revived)
+		/* a restarted daemon knows most of it from the snapshot */
+		restored = restore_state(m, &state_root);
+	/* rules for this can't look at the filesystem, it's not known yet;
+	 * partitions of a lazy disk can't be probed before it is */
+	lazy = !revived && !restored &&
+		((find_mntoptions(m) & MOPT_LAZY_PROBE) ||
+		 (m->parent && m->parent->lazy_probe));
+	m->lazy_probe = lazy;
+	if (!m->parent) {
+		if (!restored && !lazy)
+			m->medium_present = check_medium(m);
+		/* before record_diskseq, which looks at the poll interval */
+		set_media_polling(m);
+		record_diskseq(m);
+	}
 	mpres = m->parent ? m->parent->medium_present:m->medium_present;
-	if (mpres && !m->type)
+	if (mpres && !m->type && !restored && !lazy)
 		/* if no FS_TYPE passed but there is a medium, run vol_id ourselves */
 		get_dev_infos(m);
 
+	if (!m->root)
+		m->root = root ? root : m->parent ? m->parent->root : find_root(m);
+	if (state_root) {
+		if (!streq(state_root, m->root->dir)) {
+			/* the config moved it to another root */
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", state_root, m->dir);
+			rmdir(path);
+		}
+		free(state_root);
+	}
+
 	/* add permanent alias only if different from mountpoint */
 	if (perm_alias && perm_alias[0] && !streq(perm_alias, m->dir))
 		mnt_add_alias(m, perm_alias, AF_PERM);
-	mnt_add_model_alias(m);
-	mnt_add_label_alias(m, 0);
-	mnt_add_uuid_alias(m, 0);
-	match_aliases(m, 0, 0);
+	if (!revived && restored != 2) {
+		/* a reconnected or restored device still has all of them */
+		mnt_add_model_alias(m);
+		if (!lazy) {
+			mnt_add_label_alias(m, 0);
+			mnt_add_uuid_alias(m, 0);
+		}
+		match_aliases(m, 0, 0);
+	}
 
 	options = find_mntoptions(m);
 	if (options & MOPT_NO_AUTOMOUNT)
 		m->no_automount = 1;
+	m->mount_siblings = !!(options & MOPT_MOUNT_SIBLINGS);
 
 	msgbuf = alloca((m->vendor ? strlen(m->vendor) : 0) +
 					(m->model ? strlen(m->model) : 0) +
@@ -423,7 +765,9 @@ static void add_mount(const char *dev, const char *perm_alias,
 		strcat(msgbuf, m->model);
 	}
 	if (*msgbuf) strcat(msgbuf, ", ");
-	if (!mpres)
+	if (lazy)
+		strcat(msgbuf, "not probed yet");
+	else if (!mpres)
 		strcat(msgbuf, "no medium");
 	else if (!m->type)
 		strcat(msgbuf, "no filesystem");
@@ -434,7 +778,11 @@ static void add_mount(const char *dev, const char *perm_alias,
 		sprintf(msgbuf+strlen(msgbuf), "%s filesystem without label",
 				m->type);
 
-	if (!m->partition && !m->type) {
+	if (revived)
+		msg("%s/%s reconnected as %s", m->root->dir, m->dir, m->dev);
+	else if (restored)
+		debug("%s/%s taken over (%s)", m->root->dir, m->dir, msgbuf);
+	else if (!m->partition && !m->type && !lazy) {
 		/* delay the message if it looks like a partitioned device,
 		 * the printout will be suppressed if children appear */
 		pthread_t newthread;
@@ -445,23 +793,182 @@ static void add_mount(const char *dev, const char *perm_alias,
 		}
 	}
 	else {
-		msg("new %s/%s available (%s)", autodir, m->dir, msgbuf);
+		msg("new %s/%s available (%s)", m->root->dir, m->dir, msgbuf);
 		if (!m->parent && m->serial)
 			lpmsg("(serial number is %s)", m->serial);
 	}
 	mk_dir(m);
-	mk_aliases(m, m->type ? WAT_ALL : WAT_NONSPEC);
+	if (!m->mounted && claim_adopted(m->root, m->dir, m->dev)) {
+		debug("taking over existing mount of %s", m->dev);
+		m->mounted = 1;
+		inc_mounted(m->root);
+	}
+	mk_aliases(m, (m->type && !lazy) ? WAT_ALL : WAT_NONSPEC);
+	index_fs_ids(m);
+	if (!m->no_automount && (options & MOPT_PREMOUNT) && mpres && m->type) {
+		premount_key = xmalloc(sizeof(dirkey_t));
+		premount_key->root = m->root;
+		premount_key->name = xstrdup(m->dir);
+	}
+	if (m->no_automount) {
+		/* m->dir, not dev_to_dir(): a reconnected device keeps its old one */
+		noauto_root = m->root;
+		noauto_dir = xstrdup(m->dir);
+	}
 	pthread_mutex_unlock(&m->lock);
+	state_changed();
+
+	if (noauto_dir) {
+		do_mount(noauto_root, noauto_dir);
+		free(noauto_dir);
+	}
+	else if (premount_key) {
+		/* mount in the background, first access then finds it ready; it's
+		 * expired as usual if nobody uses it */
+		pthread_t newthread;
+		if (pthread_create(&newthread, &thread_detached,
+						   premount, premount_key)) {
+			warning("failed to create premount thread");
+			free((char*)premount_key->name);
+			free(premount_key);
+		}
+	}
+}
+
+static void free_mount(mnt_t *m)
+{
+	free((char*)m->dev);
+	xfree(&m->devpath);
+	free((char*)m->dir);
+	xfree(&m->label);
+	xfree(&m->type);
+	xfree(&m->uuid);
+	mnt_free_aliases(m, 0, 0);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+/* final removal of directory and aliases */
+static void drop_mount(mnt_t *m)
+{
+	rm_aliases(m, WAT_ALL);
+	rm_dir(m);
 
-	if (m->no_automount)
-		do_mount(dev_to_dir(dev));
+	if (!m->suppress_message)
+		msg("%s/%s removed", m->root->dir, m->dir);
+	free_mount(m);
 }
 
-static void rm_mount(const char *dev)
+static void *expire_lost(void *mnt)
+{
+	mnt_t **mm, *m;
+
+	sleep(config.reconnect_grace);
+
+	pthread_mutex_lock(&mounts_lock);
+	for(mm = &lost_mounts; (m = *mm); mm = &m->next) {
+		if (m == mnt) {
+			*mm = m->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mounts_lock);
+	if (m) {
+		debug("%s did not come back", m->dev);
+		drop_mount(m);
+	}
+	return NULL;
+}
+
+/* Put a removed device on lost_mounts instead of dropping it right away.
+ * Its directory and aliases stay in place; if the same medium shows up
+ * again, add_mount() continues with them. Called with m->lock held. */
+static int keep_for_reconnect(mnt_t *m)
+{
+	pthread_t newthread;
+
+	if (!config.reconnect_grace || shutting_down || !m->serial)
+		return 0;
+	pthread_mutex_unlock(&m->lock);
+	pthread_mutex_lock(&mounts_lock);
+	m->next = lost_mounts;
+	lost_mounts = m;
+	pthread_mutex_unlock(&mounts_lock);
+	if (pthread_create(&newthread, &thread_detached, expire_lost, m)) {
+		warning("failed to create thread for lost device");
+		pthread_mutex_lock(&mounts_lock);
+		lost_mounts = m->next;
+		pthread_mutex_unlock(&mounts_lock);
+		drop_mount(m);
+		return 1;
+	}
+	debug("%s removed, waiting %us for it to come back", m->dev,
+		  config.reconnect_grace);
+	return 1;
+}
+
+/* If the new device m is one that was just lost (same serial, partition
+ * and filesystem UUID), take over its directory and aliases. Returns 1 in
+ * that case. */
+static int revive_mount(mnt_t *m)
+{
+	mnt_t **ll, *l, *p;
+	int need_ids;
+
+	if (!m->serial)
+		return 0;
+	pthread_mutex_lock(&mounts_lock);
+	for(l = lost_mounts; l; l = l->next) {
+		if (streq(l->serial, m->serial) && l->partition == m->partition)
+			break;
+	}
+	need_ids = l && l->uuid && !m->uuid;
+	pthread_mutex_unlock(&mounts_lock);
+	if (!l)
+		return 0;
+	if (need_ids)
+		/* coldplug and fstab adds come without ID_FS_* */
+		get_dev_infos(m);
+
+	pthread_mutex_lock(&mounts_lock);
+	for(ll = &lost_mounts; (l = *ll); ll = &l->next) {
+		if (streq(l->serial, m->serial) && l->partition == m->partition &&
+			same_str(l->uuid, m->uuid)) {
+			*ll = l->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mounts_lock);
+	if (!l)
+		return 0;
+	debug("%s is %s reconnected", m->dev, l->dev);
+
+	/* the partNN link in the parent points to the directory */
+	if ((p = m->parent) && (p = get_mount(by_ptr, p, 0, 0)))
+		rm_child(p, m);
+	free((char*)m->dir);
+	m->dir = l->dir;
+	l->dir = NULL;
+	if (p) {
+		add_child(p, m);
+		pthread_mutex_unlock(&p->lock);
+	}
+	mnt_free_aliases(m, 0, 0);
+	m->aliases = l->aliases;
+	l->aliases = NULL;
+	m->root = l->root;
+	m->check_change_strategy = l->check_change_strategy;
+	m->suppress_message = l->suppress_message;
+	free_mount(l);
+	return 1;
+}
+
+/* returns 1 if the device was still busy and could only be detached */
+static int rm_mount(const char *dev)
 {
 	mnt_t *m, **mm;
 	char path[PATH_MAX];
-	int try = 6;
+	int try = 6, busy = 0;
 
 	debug("remove request for %s", dev);
 
@@ -474,7 +981,7 @@ static void rm_mount(const char *dev)
 	if (!(m = *mm)) {
 		debug("to-be-removed device %s unknown", dev);
 		pthread_mutex_unlock(&mounts_lock);
-		return;
+		return 0;
 	}
 	if (pthread_mutex_trylock(&m->lock)) {
 		debug("trylock13 %x %s failed", &m->lock, m->dev);
@@ -491,18 +998,20 @@ static void rm_mount(const char *dev)
 		if (try--)
 			goto again;
 		else
-			return;
+			return 0;
 	}
 	*mm = m->next;
+	unhash_mount(m);
 	pthread_mutex_unlock(&mounts_lock);
 
-	mkpath(path, m->dir);
+	mkpath(path, m->root, m->dir);
 	if (umount(path) == 0)
-		dec_mounted();
+		dec_mounted(m->root);
 	else if (errno == EBUSY) {
 			umount2(path, MNT_DETACH);
 			warning("%s still busy, will be unmounted later", path);
-			dec_mounted();
+			dec_mounted(m->root);
+			busy = 1;
 	}
 	else if (errno != EINVAL && errno != ENOENT)
 		warning("umount(%s): %s", path, strerror(errno));
@@ -519,20 +1028,118 @@ static void rm_mount(const char *dev)
 		rm_child(p, m);
 		pthread_mutex_unlock(&p->lock);
 	}
-	rm_aliases(m, WAT_ALL);
-	rm_dir(m);
+	restore_media_polling(m);
+	close_ctl_fd(m);
+	if (m->devpath)
+		forget_dev_infos(m->devpath);
+	unindex_fs_ids(m->dev);
+	state_changed();
+	if (!keep_for_reconnect(m))
+		drop_mount(m);
+	return busy;
+}
 
-	if (!m->suppress_message)
-		msg("%s/%s removed", autodir, m->dir);
-	free((char*)m->dev);
-	xfree(&m->devpath);
-	free((char*)m->dir);
-	xfree(&m->label);
-	xfree(&m->type);
-	xfree(&m->uuid);
-	mnt_free_aliases(m, 0, 0);
-	pthread_mutex_destroy(&m->lock);
-	free(m);
+static void *umount_for_eject(void *_key)
+{
+	dirkey_t *key = _key;
+	long rv = umount_dev(key->root, key->name, 1);
+
+	free((char*)key->name);
+	free(key);
+	return (void*)rv;
+}
+
+/* The eject button of a drive was pressed: unmount all filesystems on it in
+ * parallel and eject the medium, instead of letting the user wait for the
+ * mounts to expire. Called with m->lock held, which is released. */
+static void eject_request(mnt_t *m)
+{
+	mnt_t *s;
+	dirkey_t *key;
+	char dev[strlen(m->dev)+1];
+	pthread_t threads[m->n_children+1];
+	unsigned n = 0, i;
+	void *rv;
+	int busy = 0;
+
+	strcpy(dev, m->dev);
+	msg("%s: eject requested", dev);
+	pthread_mutex_lock(&mounts_lock);
+	for(s = mounts; s; s = s->next) {
+		if ((s != m && s->parent != m) || !s->mounted || n > m->n_children)
+			continue;
+		key = xmalloc(sizeof(dirkey_t));
+		key->root = s->root;
+		key->name = xstrdup(s->dir);
+		if (pthread_create(&threads[n], NULL, umount_for_eject, key)) {
+			warning("failed to create umount thread");
+			free((char*)key->name);
+			free(key);
+			busy = 1;
+			continue;
+		}
+		++n;
+	}
+	pthread_mutex_unlock(&mounts_lock);
+	/* umount_dev() needs the lock for m itself */
+	pthread_mutex_unlock(&m->lock);
+
+	for(i = 0; i < n; ++i) {
+		pthread_join(threads[i], &rv);
+		/* a device that's gone meanwhile doesn't hold up the eject */
+		if ((long)rv == UMOUNT_BUSY)
+			busy = 1;
+	}
+	if (busy) {
+		warning("%s: still in use, not ejecting", dev);
+		return;
+	}
+
+	if ((m = get_mount(by_dev, dev, 0, 0))) {
+		eject_medium(m);
+		pthread_mutex_unlock(&m->lock);
+	}
+}
+
+static int has_eject_request(unsigned n, char **ids)
+{
+	unsigned i;
+
+	for(i = 0; i < n; ++i) {
+		if (streq(ids[i], "DISK_EJECT_REQUEST=1"))
+			return 1;
+	}
+	return 0;
+}
+
+static void change_mount(const char *dev, unsigned n, char **ids)
+{
+	mnt_t *m;
+	char path[PATH_MAX];
+
+	debug("change request for %s", dev);
+	if (!(m = get_mount(by_dev, dev, 0, 0))) {
+		add_mount(dev, NULL, NULL, n, ids);
+		return;
+	}
+
+	if (has_eject_request(n, ids)) {
+		eject_request(m);
+		return;
+	}
+
+	if (apply_change_event(m, n, ids) && m->mounted) {
+		/* the filesystem we had mounted is gone */
+		mkpath(path, m->root, m->dir);
+		if (umount2(path, MNT_DETACH) == 0 || errno == EINVAL) {
+			warning("%s: medium changed while mounted", path);
+			m->mounted = 0;
+			rm_mtab(path);
+			dec_mounted(m->root);
+		}
+	}
+	pthread_mutex_unlock(&m->lock);
+	state_changed();
 }
 
 static void *handle_cmd(void *arg)
@@ -555,7 +1162,7 @@ static void *handle_cmd(void *arg)
 		close(fd);
 		return NULL;
 	}
-	if (cmd != '+' && cmd != '-') {
+	if (cmd != '+' && cmd != '-' && cmd != '*') {
 		error("bad command '%c'", cmd);
 		close(fd);
 		return NULL;
@@ -572,7 +1179,9 @@ static void *handle_cmd(void *arg)
 	close(fd);
 	
 	if (cmd == '+')
-		add_mount(dev, NULL, n, ids);
+		add_mount(dev, NULL, NULL, n, ids);
+	else if (cmd == '*')
+		change_mount(dev, n, ids);
 	else
 		rm_mount(dev);
 
@@ -614,82 +1223,358 @@ static void make_pidfile(void)
 	fclose(f);
 }
 
-void add_mount_with_devpath(const char *devname, const char *devpath)
+/* partn as from event_partition() */
+void add_mount_with_devpath(const char *devname, const char *devpath,
+							int partn)
 {
-	char *ids[1];
+	char *ids[3];
+	unsigned n = 1;
+
 	ids[0] = alloca(strlen("DEVPATH=")+strlen(devpath)+1);
 	sprintf(ids[0], "DEVPATH=%s", devpath);
-	add_mount(devname, NULL, 1, ids);
+	if (partn >= 0) {
+		ids[n++] = partn ? "DEVTYPE=partition" : "DEVTYPE=disk";
+		if (partn) {
+			ids[n] = alloca(24);
+			sprintf(ids[n++], "PARTN=%d", partn);
+		}
+	}
+	add_mount(devname, NULL, NULL, n, ids);
 }
 
-static void *scan_fstab(void *dummy)
+/* the /media entries of /etc/fstab we have applied */
+typedef struct _fstab_ent {
+	struct _fstab_ent *next;
+	const char *fsname;
+	const char *dir;
+	const char *type;
+	const char *opts;
+} fstab_ent_t;
+
+static fstab_ent_t *fstab_ents = NULL;
+
+/* returns the device an fstab entry refers to, or NULL */
+static const char *fstab_dev(fstab_ent_t *e, char *buf, size_t size)
+{
+	size_t pos;
+
+	if (!(pos = is_name_eq_val(e->fsname)))
+		return e->fsname;
+	{
+		char prop[pos+1];
+		snprintf(prop, pos+1, "%s", e->fsname);
+		if (!find_by_property(prop, e->fsname+pos+1, buf, size))
+			return NULL;
+	}
+	return buf;
+}
+
+static void add_fstab_options(fstab_ent_t *e)
+{
+	mcond_t *c;
+
+	c = new_mcond(MWH_MTABDEVNAME, MOP_EQ, e->fsname);
+	if (!streq(e->type, "subfs"))
+		c->next = new_mcond(MWH_FSTYPE, MOP_EQ, e->type);
+	add_fsoptions(c, e->opts);
+}
+
+static void apply_fstab_ent(fstab_ent_t *e)
+{
+	autoroot_t *r;
+	const char *p, *devname;
+	char devname_buf[512];
+
+	debug("found mount %s -> %s with options %s in /etc/fstab",
+		  e->fsname, e->dir, e->opts);
+	if (!(r = root_of_path(e->dir, &p)) ||
+		!(devname = fstab_dev(e, devname_buf, sizeof(devname_buf))))
+		return;
+	add_mount(devname, r, p, 0, NULL);
+	add_fstab_options(e);
+}
+
+/* undo apply_fstab_ent() for an entry removed from /etc/fstab */
+static void unapply_fstab_ent(fstab_ent_t *e)
+{
+	autoroot_t *r;
+	const char *p, *devname;
+	char devname_buf[512], sysname[PATH_MAX];
+	mnt_t *m;
+
+	debug("mount %s -> %s removed from /etc/fstab", e->fsname, e->dir);
+	remove_fstab_fsoptions(e->fsname);
+	if (!(r = root_of_path(e->dir, &p)) ||
+		!(devname = fstab_dev(e, devname_buf, sizeof(devname_buf))) ||
+		!(m = get_mount(by_dev, devname, 0, 0)))
+		return;
+	mnt_rm_alias(m, p);
+	pthread_mutex_unlock(&m->lock);
+
+	/* device was only registered because of the fstab entry */
+	snprintf(sysname, sizeof(sysname), "/sys/class/block/%s",
+			 strprefix(devname, "/dev/") ? devname+5 : devname);
+	if (access(sysname, F_OK))
+		rm_mount(devname);
+}
+
+static void free_fstab_ent(fstab_ent_t *e)
+{
+	free((char*)e->fsname);
+	free((char*)e->dir);
+	free((char*)e->type);
+	free((char*)e->opts);
+	free(e);
+}
+
+static fstab_ent_t *find_fstab_ent(fstab_ent_t *list, fstab_ent_t *e)
+{
+	for(; list; list = list->next) {
+		if (streq(list->fsname, e->fsname) && streq(list->dir, e->dir))
+			return list;
+	}
+	return NULL;
+}
+
+/* read /etc/fstab and apply what changed since the last time */
+static void scan_fstab_entries(void)
 {
-	struct sysinfo si;
 	FILE *f;
 	mntent_list_t m;
 	const char *p;
+	fstab_ent_t *new = NULL, **tail = &new, *e, *o;
+
+	if ((f = setmntent(ETC_FSTAB, "r"))) {
+		while(getmntent_r(f, &m.ent, m.buf, sizeof(m.buf))) {
+			if (!root_of_path(m.ent.mnt_dir, &p) ||
+				!hasmntopt(&m.ent, "noauto"))
+				continue;
+			e = xmalloc(sizeof(fstab_ent_t));
+			e->fsname = xstrdup(m.ent.mnt_fsname);
+			e->dir = xstrdup(m.ent.mnt_dir);
+			e->type = xstrdup(m.ent.mnt_type);
+			e->opts = xstrdup(m.ent.mnt_opts);
+			e->next = NULL;
+			*tail = e;
+			tail = &e->next;
+		}
+		endmntent(f);
+	}
 
-	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
+	for(o = fstab_ents; o; o = o->next) {
+		if (!find_fstab_ent(new, o))
+			unapply_fstab_ent(o);
+	}
+	for(e = new; e; e = e->next) {
+		if (!(o = find_fstab_ent(fstab_ents, e)))
+			apply_fstab_ent(e);
+		else if (!streq(o->type, e->type) || !streq(o->opts, e->opts)) {
+			debug("options of %s -> %s changed in /etc/fstab to %s",
+				  e->fsname, e->dir, e->opts);
+			remove_fstab_fsoptions(e->fsname);
+			add_fstab_options(e);
+		}
+	}
 
-	sysinfo(&si);
-	debug("scan_fstab thread started at uptime=%u", si.uptime);
-	if (si.uptime < 10) {
-		debug("scan_fstab: wait for %us",10 - si.uptime);
-		sleep(10 - si.uptime);
-		debug("done, now scanning");
+	while((o = fstab_ents)) {
+		fstab_ents = o->next;
+		free_fstab_ent(o);
 	}
+	fstab_ents = new;
+}
 
-	if (!(f = setmntent(ETC_FSTAB, "r")))
-		return NULL;
-	while(getmntent_r(f, &m.ent, m.buf, sizeof(m.buf))) {
-		if ((p = strprefix(m.ent.mnt_dir, autodir)) && *p == '/' &&
-			hasmntopt(&m.ent, "noauto")) {
-			const char *devname = m.ent.mnt_fsname;
-			char devname_buf[512];
-			size_t pos;
-			mcond_t *c;
-
-			debug("found mount %s -> %s with options %s in /etc/fstab",
-				  devname, m.ent.mnt_dir, m.ent.mnt_opts);
-
-			if ((pos = is_name_eq_val(devname))) {
-				char prop[pos+1];
-				snprintf(prop, pos+1, "%s", devname);
-				if (!find_by_property(prop, devname+pos+1,
-									  devname_buf, sizeof(devname_buf)))
-					continue;
-				devname = devname_buf;
-			}
+/* rescan /etc/fstab whenever it's written or replaced */
+static void watch_fstab(void)
+{
+	char dir[sizeof(ETC_FSTAB)], *name;
+	char buf[sizeof(struct inotify_event)+NAME_MAX+1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t n;
+	int fd, changed;
+
+	strcpy(dir, ETC_FSTAB);
+	name = strrchr(dir, '/');
+	*name++ = '\0';
+	if ((fd = inotify_init1(IN_CLOEXEC)) < 0 ||
+		inotify_add_watch(fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) < 0) {
+		warning("cannot watch %s: %s", ETC_FSTAB, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
 
-			add_mount(devname, m.ent.mnt_dir+strlen(autodir)+1, 0, NULL);
-			c = new_mcond(MWH_MTABDEVNAME, MOP_EQ, m.ent.mnt_fsname);
-			if (!streq(m.ent.mnt_type, "subfs"))
-				c->next = new_mcond(MWH_FSTYPE, MOP_EQ, m.ent.mnt_type);
-			add_fsoptions(c, m.ent.mnt_opts);
+	while((n = read(fd, buf, sizeof(buf))) > 0 || errno == EINTR) {
+		changed = 0;
+		for(ev = (struct inotify_event*)buf; n > 0 && (char*)ev < buf+n;
+			ev = (struct inotify_event*)((char*)ev + sizeof(*ev) + ev->len)) {
+			if (ev->len && streq(ev->name, name))
+				changed = 1;
+		}
+		if (changed) {
+			debug("%s changed, rescanning", ETC_FSTAB);
+			scan_fstab_entries();
 		}
 	}
-	endmntent(f);
+	warning("reading inotify events: %s", strerror(errno));
+	close(fd);
+}
 
-	if (si.uptime >= 10)
-		coldplug();
-	else
-		debug("skip coldplug as started early");
+/* write the state snapshot for the next instance */
+static void save_state(void)
+{
+	FILE *f;
+	mnt_t *m;
 
+	if (!(f = state_create()))
+		return;
+	pthread_mutex_lock(&mounts_lock);
+	for(m = mounts; m; m = m->next) {
+		state_write_poll(f, m);
+		/* a busy device is just probed again by the next instance */
+		if (pthread_mutex_trylock(&m->lock))
+			continue;
+		state_write(f, m);
+		pthread_mutex_unlock(&m->lock);
+	}
+	pthread_mutex_unlock(&mounts_lock);
+	state_close(f);
+}
+
+/* keep the snapshot reasonably current, in case we don't exit cleanly */
+static void *save_state_thread(void *dummy)
+{
+	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
+
+	while(!shutting_down) {
+		sleep(STATE_SAVE_INTERVAL);
+		if (state_take_changed() && !shutting_down)
+			save_state();
+	}
 	return NULL;
 }
 
+static void *scan_fstab(void *dummy)
+{
+	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
+
+	/* at boot, let udev finish replaying the existing devices first */
+	udev_settle(UDEV_SETTLE_TIMEOUT);
+
+	scan_fstab_entries();
+	coldplug();
+	release_state();
+	release_adopted();
+	set_startup_done();
+
+	watch_fstab();
+	return NULL;
+}
+
+static void *shutdown_rm(void *dev)
+{
+	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
+	return (void*)(long)rm_mount(dev);
+}
+
+/* Remove all devices for shutdown: the leaves in parallel, then their
+ * parents, so that one slow medium doesn't hold up the others. Gives up on
+ * devices that are still unmounting after SHUTDOWN_TIMEOUT. */
+static void rm_all_mounts(void)
+{
+	struct timespec deadline, now;
+	mnt_t *m;
+	unsigned n, i, n_busy = 0, n_stuck = 0;
+	char **devs;
+	pthread_t *threads;
+	void *rv;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SHUTDOWN_TIMEOUT;
+	for(;;) {
+		pthread_mutex_lock(&mounts_lock);
+		for(n = 0, m = mounts; m; m = m->next)
+			++n;
+		if (!n) {
+			pthread_mutex_unlock(&mounts_lock);
+			break;
+		}
+		devs = xmalloc(n*sizeof(char*));
+		threads = xmalloc(n*sizeof(pthread_t));
+		for(n = 0, m = mounts; m; m = m->next) {
+			if (!m->n_children)
+				devs[n++] = xstrdup(m->dev);
+		}
+		pthread_mutex_unlock(&mounts_lock);
+
+		for(i = 0; i < n; ++i) {
+			if (pthread_create(&threads[i], NULL, shutdown_rm, devs[i])) {
+				warning("failed to create umount thread");
+				n_busy += rm_mount(devs[i]);
+				free(devs[i]);
+				devs[i] = NULL;
+			}
+		}
+		for(i = 0; i < n; ++i) {
+			if (!devs[i])
+				continue;
+			if (pthread_timedjoin_np(threads[i], &rv, &deadline)) {
+				/* the thread still uses devs[i] */
+				warning("%s: still unmounting at shutdown deadline", devs[i]);
+				pthread_detach(threads[i]);
+				++n_stuck;
+				continue;
+			}
+			if (rv)
+				++n_busy;
+			free(devs[i]);
+		}
+		free(devs);
+		free(threads);
+		clock_gettime(CLOCK_REALTIME, &now);
+		/* a stuck child keeps its parent */
+		if (!n || n_stuck || now.tv_sec >= deadline.tv_sec)
+			break;
+	}
+	if (n_busy || n_stuck)
+		msg("%u device(s) still busy at shutdown, %u given up on",
+			n_busy+n_stuck, n_stuck);
+}
+
 static void do_shutdown(int signr)
 {
+	mnt_t *lost, *m;
+
+	if (signr == SIGHUP) {
+		/* restart: keep autofs and mounts for the next instance */
+		msg("received signal %d, exiting and leaving automounts in place",
+			signr);
+		shutting_down = 1;
+		prepare_stop_automount();
+		save_state();
+		detach_automount();
+		unlink(SOCKNAME);
+		unlink(PIDFILE);
+		exit(0);
+	}
 	msg("received signal %d, shutting down", signr);
 	shutting_down = 1;
 	prepare_stop_automount();
 	
-	while(mounts)
-		rm_mount(mounts->dev);
-	stop_automount(autodir);
+	rm_all_mounts();
+	/* expire_lost() threads won't find them anymore then */
+	pthread_mutex_lock(&mounts_lock);
+	lost = lost_mounts;
+	lost_mounts = NULL;
+	pthread_mutex_unlock(&mounts_lock);
+	while((m = lost)) {
+		lost = m->next;
+		drop_mount(m);
+	}
+	stop_automount();
+	discard_state();
 	unlink(SOCKNAME);
 	unlink(PIDFILE);
-	udev_unref(udev);
 	debug("daemon exiting");
 	exit(0);
 }
@@ -699,7 +1584,9 @@ int used_sigs[] = { SIGHUP, SIGCHLD, SIGINT, SIGQUIT, SIGTERM, 0 };
 int daemon_main(void)
 {
 	int listen_fd;
+	pthread_t save_thread;
 	
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	openlog("mediad", LOG_NDELAY|LOG_PID|LOG_CONS, LOG_DAEMON);
 	setpgrp();
 	/* remove from systemd-udev cgroup by moving to our own group,
@@ -715,30 +1602,31 @@ int daemon_main(void)
 		error("failed to chdir");
 		return 1;
 	}
-	if (!(udev = udev_new())) {
-		error("failed to create udev context");
+	if (!thread_udev())
 		return 1;
-	}
 	sigemptyset(&termsigs);
+	sigaddset(&termsigs, SIGHUP);
 	sigaddset(&termsigs, SIGINT);
 	sigaddset(&termsigs, SIGQUIT);
 	sigaddset(&termsigs, SIGTERM);
 	pthread_sigmask(SIG_BLOCK, &termsigs, NULL);
 
+	pthread_attr_init(&thread_detached);
+	pthread_attr_setdetachstate(&thread_detached, PTHREAD_CREATE_DETACHED);
+	pthread_mutexattr_init(&rec_mutex);
+	pthread_mutexattr_settype(&rec_mutex, PTHREAD_MUTEX_RECURSIVE_NP);
+
 	make_pidfile();
 	read_config();
 	listen_fd = open_socket();
-	start_automount(autodir);
-	signal(SIGHUP, SIG_IGN);
+	/* before start_automount(), which must leave what it lists in place */
+	load_state();
+	start_automount();
 	signal(SIGCHLD, SIG_IGN);
+	signal(SIGHUP, do_shutdown);
 	signal(SIGINT, do_shutdown);
 	signal(SIGQUIT, do_shutdown);
 	signal(SIGTERM, do_shutdown);
-
-	pthread_attr_init(&thread_detached);
-	pthread_attr_setdetachstate(&thread_detached, PTHREAD_CREATE_DETACHED);
-	pthread_mutexattr_init(&rec_mutex);
-	pthread_mutexattr_settype(&rec_mutex, PTHREAD_MUTEX_RECURSIVE_NP);
 	
 	debug("daemon running");
 	kill(getppid(), SIGUSR1);
@@ -749,6 +1637,12 @@ int daemon_main(void)
 		pthread_create(&newthread, &thread_detached,
 					   scan_fstab, NULL);
 	}
+	else {
+		/* without coldplug, nothing would claim the snapshot */
+		release_state();
+		set_startup_done();
+	}
+	pthread_create(&save_thread, &thread_detached, save_state_thread, NULL);
 	
 	while(!shutting_down) {
 		int fd;
@@ -27,9 +27,181 @@
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <poll.h>
 #include <libudev.h>
+#ifdef USE_BLKID
+#include <blkid.h>
+#endif
 #include "mediad.h"
 
+/* superblocks of all filesystems we're interested in are within the first
+ * MB, no need to let blkid look further (e.g. for RAID signatures at the end
+ * of the device) */
+#define PROBE_AREA		(1024*1024)
+
+
+/* libudev contexts must not be used by more than one thread at a time, so
+ * each thread gets its own, created on first use and dropped when the thread
+ * exits. Objects obtained from it stay local to the function using them. */
+static pthread_key_t udev_key;
+static pthread_once_t udev_key_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_udev(void *u)
+{
+	udev_unref(u);
+}
+
+static void init_udev_key(void)
+{
+	pthread_key_create(&udev_key, free_thread_udev);
+}
+
+struct udev *thread_udev(void)
+{
+	struct udev *u;
+
+	pthread_once(&udev_key_once, init_udev_key);
+	if (!(u = pthread_getspecific(udev_key))) {
+		if (!(u = udev_new())) {
+			error("failed to create udev context");
+			return NULL;
+		}
+		pthread_setspecific(udev_key, u);
+	}
+	return u;
+}
+
+/* udev's private database; reading it directly is much cheaper than building
+ * a libudev device object just to look at a few properties */
+#define UDEV_DATA_DIR	"/run/udev/data"
+
+typedef struct _udevdb {
+	struct _udevdb *next;
+	char *devpath;
+	char dbname[32];		/* "b<major>:<minor>" */
+	ino_t ino;				/* identity of the db file we parsed */
+	struct timespec mtime;
+	char **props;			/* ID_* properties, "KEY=VALUE" */
+	unsigned n_props;
+} udevdb_t;
+
+static udevdb_t *udevdb_cache;
+static pthread_mutex_t udevdb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void udevdb_clear(udevdb_t *e)
+{
+	unsigned i;
+
+	for(i = 0; i < e->n_props; ++i)
+		free(e->props[i]);
+	free(e->props);
+	e->props = NULL;
+	e->n_props = 0;
+}
+
+/* (re)read the E: lines of the db file; parse_id only cares about ID_* */
+static int udevdb_load(udevdb_t *e, const char *path, const struct stat *st)
+{
+	FILE *f;
+	char line[1024];
+
+	if (!(f = fopen(path, "r")))
+		return -1;
+	udevdb_clear(e);
+	while(fgets(line, sizeof(line), f)) {
+		char *p;
+		
+		if (!strprefix(line, "E:ID_"))
+			continue;
+		if ((p = strchr(line, '\n')))
+			*p = '\0';
+		e->props = xrealloc(e->props, (e->n_props+1)*sizeof(char*));
+		e->props[e->n_props++] = xstrdup(line+2);
+	}
+	fclose(f);
+	e->ino = st->st_ino;
+	e->mtime = st->st_mtim;
+	return 0;
+}
+
+/* returns 0 if properties could be taken from the udev database */
+static int get_dev_infos_db(mnt_t *m)
+{
+	udevdb_t *e;
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned i;
+	int rv = -1;
+
+	pthread_mutex_lock(&udevdb_lock);
+	for(e = udevdb_cache; e; e = e->next) {
+		if (streq(e->devpath, m->devpath))
+			break;
+	}
+	if (!e) {
+		char devnum[32];
+		unsigned maj, min;
+
+		snprintf(path, sizeof(path), "/sys%s/dev", m->devpath);
+		if (read_sysfs_str(path, devnum, sizeof(devnum)) ||
+			sscanf(devnum, "%u:%u", &maj, &min) != 2)
+			goto out;
+		e = xmalloc(sizeof(udevdb_t));
+		memset(e, 0, sizeof(*e));
+		e->devpath = xstrdup(m->devpath);
+		sprintf(e->dbname, "b%u:%u", maj, min);
+		e->next = udevdb_cache;
+		udevdb_cache = e;
+	}
+
+	snprintf(path, sizeof(path), UDEV_DATA_DIR "/%s", e->dbname);
+	if (stat(path, &st))
+		goto out;
+	/* udev replaces the file on every event, so same inode and mtime means
+	 * our cached copy is still current */
+	if (!e->props || st.st_ino != e->ino ||
+		st.st_mtim.tv_sec != e->mtime.tv_sec ||
+		st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+		if (udevdb_load(e, path, &st))
+			goto out;
+	}
+	else
+		debug("%s: using cached udev properties", m->dev);
+
+	for(i = 0; i < e->n_props; ++i) {
+		char buf[strlen(e->props[i])+1];
+		strcpy(buf, e->props[i]);
+		replace_untrusted_chars(buf);
+		parse_id(m, buf);
+	}
+	rv = 0;
+
+  out:
+	pthread_mutex_unlock(&udevdb_lock);
+	return rv;
+}
+
+/* drop cached udev properties of a removed device */
+void forget_dev_infos(const char *devpath)
+{
+	udevdb_t **pe, *e;
+
+	pthread_mutex_lock(&udevdb_lock);
+	for(pe = &udevdb_cache; (e = *pe); pe = &e->next) {
+		if (streq(e->devpath, devpath)) {
+			*pe = e->next;
+			udevdb_clear(e);
+			free(e->devpath);
+			free(e);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&udevdb_lock);
+}
 
 void get_dev_infos(mnt_t *m)
 {
@@ -37,8 +209,12 @@ void get_dev_infos(mnt_t *m)
 	struct udev_list_entry *list_entry;
 	char sdevpath[strlen(m->devpath)+5];
 	sprintf(sdevpath, "/sys/%s", m->devpath);
+
+	if (!get_dev_infos_db(m))
+		return;
 	
-	if (!(dev = udev_device_new_from_syspath(udev, sdevpath))) {
+	/* only now: a libudev context is costly to create */
+	if (!(dev = udev_device_new_from_syspath(thread_udev(), sdevpath))) {
 		error("%s: failed to get udev object", m->dev);
 		return;
 	}
@@ -59,6 +235,408 @@ void get_dev_infos(mnt_t *m)
 	udev_device_unref(dev);
 }
 
+#ifdef USE_BLKID
+static void set_probed(const char **field, const char *val)
+{
+	char *p;
+
+	xfree(field);
+	if (!val || !*val)
+		return;
+	/* make it look like udev's ID_FS_* values */
+	*field = p = xstrdup(val);
+	for(; *p; ++p) {
+		if (isspace(*p) || *p == '/' || !isprint(*p))
+			*p = '_';
+	}
+	replace_untrusted_chars((char*)*field);
+}
+
+/* Persistent cache of probe results. The same media tend to be inserted
+ * again and again, and on slow card readers probing takes noticeable time.
+ * An entry is found by serial, partition and size. As a card reader has the
+ * same serial for all cards, it's only trusted if the first sector and the
+ * one with the volume label (see label_area()) still hash the same; these
+ * also hold the UUID and, for most filesystems, counters that change on
+ * every write mount. */
+#define PROBE_CACHE_MAX	256
+#define PROBE_CACHE_HDR	"# mediad probe cache 2\n"
+#define LABEL_AREA_MAX	4096
+
+typedef struct _probecache {
+	struct _probecache *next;
+	char *serial;
+	unsigned partition;
+	unsigned long long size;
+	unsigned long long hash;
+	char *type, *uuid, *label;
+} probecache_t;
+
+static probecache_t *probecache;
+static int probecache_loaded;
+static pthread_mutex_t probecache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_probecache(probecache_t *e)
+{
+	free(e->serial);
+	free(e->type);
+	free(e->uuid);
+	free(e->label);
+	free(e);
+}
+
+static char *cache_field(char **p)
+{
+	char *f = strsep(p, "\t\n");
+	return (f && *f) ? xstrdup(f) : NULL;
+}
+
+static void load_probecache(void)
+{
+	FILE *f;
+	char line[1024], *p, *num;
+	probecache_t *e, **tail = &probecache;
+	unsigned n = 0;
+
+	probecache_loaded = 1;
+	if (!(f = fopen(PROBE_CACHE, "r")))
+		return;
+	/* entries of older formats can't be validated */
+	if (!fgets(line, sizeof(line), f) || !streq(line, PROBE_CACHE_HDR)) {
+		fclose(f);
+		return;
+	}
+	while(n < PROBE_CACHE_MAX && fgets(line, sizeof(line), f)) {
+		e = xmalloc(sizeof(probecache_t));
+		memset(e, 0, sizeof(*e));
+		p = line;
+		e->serial = cache_field(&p);
+		if (!(num = strsep(&p, "\t")) ||
+			sscanf(num, "%u", &e->partition) != 1 ||
+			!(num = strsep(&p, "\t")) || sscanf(num, "%llu", &e->size) != 1 ||
+			!(num = strsep(&p, "\t")) || sscanf(num, "%llx", &e->hash) != 1 ||
+			!e->serial || !p || !(e->type = cache_field(&p))) {
+			free_probecache(e);
+			continue;
+		}
+		e->uuid = p ? cache_field(&p) : NULL;
+		e->label = p ? cache_field(&p) : NULL;
+		*tail = e;
+		tail = &e->next;
+		++n;
+	}
+	fclose(f);
+	debug("loaded %u entries from " PROBE_CACHE, n);
+}
+
+static void save_probecache(void)
+{
+	FILE *f;
+	probecache_t *e;
+	char tmp[] = PROBE_CACHE ".new";
+
+	if (mkdir(STATEDIR, 0755) && errno != EEXIST) {
+		debug("mkdir(" STATEDIR "): %s", strerror(errno));
+		return;
+	}
+	if (!(f = fopen(tmp, "w"))) {
+		debug("cannot create %s: %s", tmp, strerror(errno));
+		return;
+	}
+	fputs(PROBE_CACHE_HDR, f);
+	for(e = probecache; e; e = e->next)
+		fprintf(f, "%s\t%u\t%llu\t%llx\t%s\t%s\t%s\n",
+				e->serial, e->partition, e->size, e->hash, e->type,
+				e->uuid ? e->uuid : "", e->label ? e->label : "");
+	if (fclose(f) || rename(tmp, PROBE_CACHE)) {
+		debug("cannot write " PROBE_CACHE ": %s", strerror(errno));
+		unlink(tmp);
+	}
+}
+
+#define LE16(p)		((p)[0] | (p)[1] << 8)
+#define LE32(p)		(LE16(p) | (unsigned)LE16((p)+2) << 16)
+#define LE64(p)		(LE32(p) | (unsigned long long)LE32((p)+4) << 32)
+
+static int valid_sector_size(unsigned bps)
+{
+	return bps >= 512 && bps <= 4096 && !(bps & (bps-1));
+}
+
+/* Where a filesystem of this type keeps its label, given its first sector
+ * b. That's the superblock for most, but the root directory for FAT and
+ * exFAT and the $Volume record for NTFS. Returns -1 for types we don't know
+ * (which aren't cached then). */
+static int label_area(const char *type, const unsigned char *b,
+					  unsigned long long *off, unsigned *len)
+{
+	*len = 512;
+	if (streq(type, "ext2") || streq(type, "ext3") || streq(type, "ext4")) {
+		*off = 1024;
+	}
+	else if (streq(type, "xfs")) {
+		*off = 0;
+	}
+	else if (streq(type, "btrfs")) {
+		*off = 65536;
+	}
+	else if (streq(type, "iso9660")) {
+		/* primary descriptor and the Joliet one usually following it */
+		*off = 32768;
+		*len = 4096;
+	}
+	else if (streq(type, "vfat")) {
+		unsigned bps = LE16(b+0x0b), spc = b[0x0d], rsvd = LE16(b+0x0e);
+		unsigned nfats = b[0x10], fatsz = LE16(b+0x16);
+
+		if (!valid_sector_size(bps) || !spc)
+			return -1;
+		if (fatsz) {
+			/* FAT12/16: fixed root directory after the FATs */
+			*off = (unsigned long long)(rsvd + nfats*fatsz) * bps;
+			*len = LE16(b+0x11) * 32;
+		}
+		else {
+			/* FAT32: root directory is a cluster chain */
+			unsigned long long data = rsvd + (unsigned long long)nfats*LE32(b+0x24);
+			*off = (data + (LE32(b+0x2c)-2ULL)*spc) * bps;
+			*len = spc * bps;
+		}
+	}
+	else if (streq(type, "exfat")) {
+		unsigned bps_shift = b[0x6c], spc_shift = b[0x6d];
+
+		if (bps_shift < 9 || bps_shift > 12 || spc_shift > 25)
+			return -1;
+		*off = ((unsigned long long)LE32(b+0x58) +
+				((LE32(b+0x60)-2ULL) << spc_shift)) << bps_shift;
+		*len = 1 << (bps_shift + spc_shift);
+	}
+	else if (streq(type, "ntfs")) {
+		unsigned bps = LE16(b+0x0b), spc = b[0x0d];
+		signed char cpr = b[0x40];
+		unsigned long long csize;
+
+		if (!valid_sector_size(bps) || !spc)
+			return -1;
+		/* large clusters are given as negative power of two */
+		csize = spc > 0x80 ? (unsigned long long)bps << (256-spc) :
+			(unsigned long long)spc * bps;
+		*len = cpr > 0 ? cpr * csize : 1U << -cpr;
+		/* $Volume is MFT record 3 */
+		*off = LE64(b+0x30) * csize + 3ULL * *len;
+	}
+	else
+		return -1;
+	if (!*len || *len > LABEL_AREA_MAX)
+		*len = LABEL_AREA_MAX;
+	return 0;
+}
+
+/* FNV-1a of the first sector and the label area of a filesystem */
+static int hash_fs_ids(int fd, const char *type, unsigned long long *hash)
+{
+	unsigned char b0[512], buf[LABEL_AREA_MAX];
+	unsigned long long h = 0xcbf29ce484222325ULL, off;
+	unsigned i, len;
+
+	if (pread(fd, b0, sizeof(b0), 0) != sizeof(b0) ||
+		label_area(type, b0, &off, &len) ||
+		pread(fd, buf, len, off) != len)
+		return -1;
+	for(i = 0; i < sizeof(b0); ++i) {
+		h ^= b0[i];
+		h *= 0x100000001b3ULL;
+	}
+	for(i = 0; i < len; ++i) {
+		h ^= buf[i];
+		h *= 0x100000001b3ULL;
+	}
+	*hash = h;
+	return 0;
+}
+
+static long long dev_size(mnt_t *m)
+{
+	char path[PATH_MAX];
+	long long size;
+
+	if (!m->devpath)
+		return -1;
+	snprintf(path, sizeof(path), "/sys%s/size", m->devpath);
+	return read_sysfs_num(path, &size) ? -1 : size;
+}
+
+static probecache_t **find_probecache(mnt_t *m, unsigned long long size)
+{
+	probecache_t **pe;
+
+	if (!probecache_loaded)
+		load_probecache();
+	for(pe = &probecache; *pe; pe = &(*pe)->next) {
+		if (streq((*pe)->serial, m->serial) &&
+			(*pe)->partition == m->partition && (*pe)->size == size)
+			return pe;
+	}
+	return NULL;
+}
+
+/* returns 0 if m's infos could be taken from the cache */
+static int probe_cached(mnt_t *m, int fd)
+{
+	probecache_t **pe, *e;
+	unsigned long long hash;
+	long long size;
+	int rv = -1;
+
+	if (!m->serial || (size = dev_size(m)) <= 0)
+		return -1;
+	pthread_mutex_lock(&probecache_lock);
+	if (!(pe = find_probecache(m, size)))
+		goto out;
+	e = *pe;
+	if (hash_fs_ids(fd, e->type, &hash) || hash != e->hash)
+		goto out;
+	/* move to front (in memory only; no need to rewrite the file) */
+	*pe = e->next;
+	e->next = probecache;
+	probecache = e;
+	set_probed(&m->type, e->type);
+	set_probed(&m->label, e->label);
+	set_probed(&m->uuid, e->uuid);
+	debug("%s: known medium, type=%s label=%s uuid=%s", m->dev,
+		  m->type, m->label ? m->label : "-", m->uuid ? m->uuid : "-");
+	rv = 0;
+  out:
+	pthread_mutex_unlock(&probecache_lock);
+	return rv;
+}
+
+/* remember what was just probed on m */
+static void add_probecache(mnt_t *m, int fd)
+{
+	probecache_t **pe, *e;
+	unsigned long long hash;
+	long long size;
+	unsigned n;
+
+	if (!m->serial || !m->type || (size = dev_size(m)) <= 0 ||
+		hash_fs_ids(fd, m->type, &hash))
+		return;
+
+	pthread_mutex_lock(&probecache_lock);
+	if ((pe = find_probecache(m, size))) {
+		e = *pe;
+		/* unchanged, spare the rewrite */
+		if (e->hash == hash) {
+			pthread_mutex_unlock(&probecache_lock);
+			return;
+		}
+		*pe = e->next;
+		free_probecache(e);
+	}
+	e = xmalloc(sizeof(probecache_t));
+	e->serial = xstrdup(m->serial);
+	e->partition = m->partition;
+	e->size = size;
+	e->hash = hash;
+	e->type = xstrdup(m->type);
+	e->uuid = m->uuid ? xstrdup(m->uuid) : NULL;
+	e->label = m->label ? xstrdup(m->label) : NULL;
+	e->next = probecache;
+	probecache = e;
+	for(n = 1, pe = &probecache->next; *pe; pe = &(*pe)->next) {
+		if (++n > PROBE_CACHE_MAX) {
+			e = *pe;
+			*pe = NULL;
+			while(e) {
+				probecache_t *next = e->next;
+				free_probecache(e);
+				e = next;
+			}
+			break;
+		}
+	}
+	save_probecache();
+	pthread_mutex_unlock(&probecache_lock);
+}
+
+
+/* look at the superblock on fd ourselves; returns 0 on success (which may
+ * also mean that there's no filesystem), -1 if the caller should ask udev */
+static int probe_fs(mnt_t *m, int fd)
+{
+	blkid_probe pr;
+	const char *val;
+	blkid_loff_t size;
+	int rv;
+
+	if (probe_cached(m, fd) == 0)
+		return 0;
+	if (!(pr = blkid_new_probe()))
+		return -1;
+	if (blkid_probe_set_device(pr, fd, 0, 0)) {
+		blkid_free_probe(pr);
+		return -1;
+	}
+	size = blkid_probe_get_size(pr);
+	if (size > PROBE_AREA)
+		blkid_probe_set_device(pr, fd, 0, PROBE_AREA);
+	blkid_probe_enable_partitions(pr, 0);
+	blkid_probe_enable_superblocks(pr, 1);
+	blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE |
+									  BLKID_SUBLKS_LABEL | BLKID_SUBLKS_UUID);
+
+	if ((rv = blkid_do_safeprobe(pr)) < 0) {
+		debug("%s: blkid probe failed (%d)", m->dev, rv);
+		blkid_free_probe(pr);
+		return -1;
+	}
+	val = NULL;
+	if (rv == 0)
+		blkid_probe_lookup_value(pr, "TYPE", &val, NULL);
+	set_probed(&m->type, val);
+	val = NULL;
+	if (rv == 0)
+		blkid_probe_lookup_value(pr, "LABEL", &val, NULL);
+	set_probed(&m->label, val);
+	val = NULL;
+	if (rv == 0)
+		blkid_probe_lookup_value(pr, "UUID", &val, NULL);
+	set_probed(&m->uuid, val);
+	blkid_free_probe(pr);
+	add_probecache(m, fd);
+
+	debug("%s: probed type=%s label=%s uuid=%s", m->dev,
+		  m->type ? m->type : "-", m->label ? m->label : "-",
+		  m->uuid ? m->uuid : "-");
+	return 0;
+}
+#endif
+
+/* Get filesystem infos for a medium that has just been found to be changed.
+ * With libblkid, a medium known from the probe cache needs no probing, and
+ * other superblocks are read directly from fd (or a new fd if it is < 0),
+ * otherwise (and as fallback) from the udev database, which may still
+ * describe the old medium if udev hasn't caught up yet. */
+void probe_dev_infos(mnt_t *m, int fd)
+{
+#ifdef USE_BLKID
+	int myfd = -1, rv;
+
+	if (fd < 0)
+		fd = myfd = open(m->dev, O_RDONLY|O_NONBLOCK);
+	if (fd >= 0) {
+		rv = probe_fs(m, fd);
+		if (myfd >= 0)
+			close(myfd);
+		if (rv == 0)
+			return;
+	}
+#endif
+	get_dev_infos(m);
+}
+
 void find_devpath(mnt_t *m)
 {
 	const char *devname = m->dev, *p;
@@ -69,7 +647,19 @@ void find_devpath(mnt_t *m)
 	if ((p = strprefix(devname, "/dev/")))
 		devname = p;
 
-	if (!(dev = udev_device_new_from_subsystem_sysname(udev, "block", devname))) {
+	/* /sys/class/block/<name> links to the device, which is our devpath */
+	{
+		char link[strlen(devname)+18], rpath[PATH_MAX];
+		sprintf(link, "/sys/class/block/%s", devname);
+		if (realpath(link, rpath) && (p = strprefix(rpath, "/sys/"))) {
+			m->devpath = xstrdup(p-1);
+			debug("found devpath=%s for %s", m->devpath, m->dev);
+			return;
+		}
+	}
+
+	if (!(dev = udev_device_new_from_subsystem_sysname(thread_udev(), "block",
+													   devname))) {
 		error("%s: failed to get udev object", m->dev);
 		return;
 	}
@@ -80,46 +670,131 @@ void find_devpath(mnt_t *m)
 		  m->devpath ? m->devpath : "NONE", m->dev);
 }
 
-int find_by_property(const char *propname, const char *propval,
-					 char *outname, size_t outsize)
+/* LABEL=/UUID= index for /etc/fstab entries: built by one enumeration on
+ * first use, then kept up to date by add/change/remove of devices */
+typedef struct _fsidx {
+	struct _fsidx *next;
+	const char *dev;
+	const char *label;
+	const char *uuid;
+} fsidx_t;
+
+static fsidx_t *fsidx;
+static int fsidx_built;
+static pthread_mutex_t fsidx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fsidx_set(const char *dev, const char *label, const char *uuid)
+{
+	fsidx_t **pe, *e;
+
+	for(pe = &fsidx; (e = *pe); pe = &e->next) {
+		if (streq(e->dev, dev)) {
+			*pe = e->next;
+			free((char*)e->dev);
+			xfree(&e->label);
+			xfree(&e->uuid);
+			free(e);
+			break;
+		}
+	}
+	if (!label && !uuid)
+		return;
+	e = xmalloc(sizeof(fsidx_t));
+	e->dev = xstrdup(dev);
+	e->label = label ? xstrdup(label) : NULL;
+	e->uuid = uuid ? xstrdup(uuid) : NULL;
+	e->next = fsidx;
+	fsidx = e;
+}
+
+static void build_fsidx(void)
 {
+	struct udev *udev = thread_udev();
 	struct udev_enumerate *d_enum;
 	struct udev_list_entry *d_ent;
+	unsigned n = 0;
 
-	*outname = '\0';
-	
-	if (streq(propname, "LABEL"))
-		propname = "ID_FS_LABEL";
-	else if (streq(propname, "UUID"))
-		propname = "ID_FS_UUID";
-	else {
-		warning("find_by_property: unhandled property '%s' (from /etc/fstab)",
-				propname);
-		return 0;
-	}
-	
+	fsidx_built = 1;
 	if (!(d_enum = udev_enumerate_new(udev))) {
 		error("cannot create udev enumerator");
-		return 0;
+		return;
 	}
 	udev_enumerate_add_match_subsystem(d_enum, "block");
-	udev_enumerate_add_match_property(d_enum, propname, propval);
 	udev_enumerate_scan_devices(d_enum);
 
 	udev_list_entry_foreach(d_ent, udev_enumerate_get_list_entry(d_enum)) {
 		struct udev_device *dev =
 			udev_device_new_from_syspath
 			(udev, udev_list_entry_get_name(d_ent));
+		const char *label, *uuid;
+		char devname[PATH_MAX];
+
 		if (!dev)
 			continue;
+		label = udev_device_get_property_value(dev, "ID_FS_LABEL");
+		uuid = udev_device_get_property_value(dev, "ID_FS_UUID");
+		if (label || uuid) {
+			snprintf(devname, sizeof(devname), "/dev/%s",
+					 udev_device_get_sysname(dev));
+			fsidx_set(devname, label, uuid);
+			++n;
+		}
+		udev_device_unref(dev);
+	}
+	udev_enumerate_unref(d_enum);
+	debug("indexed %u filesystem labels/UUIDs", n);
+}
+
+/* keep the index current for m (only once it exists) */
+void index_fs_ids(mnt_t *m)
+{
+	pthread_mutex_lock(&fsidx_lock);
+	if (fsidx_built)
+		fsidx_set(m->dev, m->type ? m->label : NULL,
+				  m->type ? m->uuid : NULL);
+	pthread_mutex_unlock(&fsidx_lock);
+}
+
+void unindex_fs_ids(const char *dev)
+{
+	pthread_mutex_lock(&fsidx_lock);
+	if (fsidx_built)
+		fsidx_set(dev, NULL, NULL);
+	pthread_mutex_unlock(&fsidx_lock);
+}
+
+int find_by_property(const char *propname, const char *propval,
+					 char *outname, size_t outsize)
+{
+	fsidx_t *e;
+	int label;
+
+	*outname = '\0';
+	
+	if (streq(propname, "LABEL"))
+		label = 1;
+	else if (streq(propname, "UUID"))
+		label = 0;
+	else {
+		warning("find_by_property: unhandled property '%s' (from /etc/fstab)",
+				propname);
+		return 0;
+	}
+
+	pthread_mutex_lock(&fsidx_lock);
+	if (!fsidx_built)
+		build_fsidx();
+	for(e = fsidx; e; e = e->next) {
+		const char *val = label ? e->label : e->uuid;
+		if (!val || !streq(val, propval))
+			continue;
 		if (!outname[0])
-			snprintf(outname, outsize, "/dev/%s", udev_device_get_sysname(dev));
+			snprintf(outname, outsize, "%s", e->dev);
 		else	
 			warning("ambigous %s=%s (%s and %s are matching)",
-					propname, propval, outname,
-					udev_device_get_sysname(dev));
+					propname, propval, outname, e->dev);
 	}
-	udev_enumerate_unref(d_enum);
+	pthread_mutex_unlock(&fsidx_lock);
 
 	if (!outname[0]) {
 		warning("no device found for %s=%s", propname, propval);
@@ -128,54 +803,202 @@ int find_by_property(const char *propname, const char *propval,
 	return 1;
 }
 
-/* replay events of already existing devices (at start time) */
+/* wait until udev has processed all queued events (e.g. the replay of
+ * existing devices at boot), but at most timeout seconds */
+void udev_settle(unsigned timeout)
+{
+	struct udev *udev = thread_udev();
+	struct udev_queue *queue;
+	struct pollfd pfd;
+	struct timespec t0, now;
+	long left;
+
+	if (!(queue = udev_queue_new(udev))) {
+		warning("cannot access udev queue, not waiting for it");
+		return;
+	}
+	pfd.fd = udev_queue_get_fd(queue);
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(!udev_queue_get_queue_is_empty(queue)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = timeout*1000 - ((now.tv_sec-t0.tv_sec)*1000 +
+							   (now.tv_nsec-t0.tv_nsec)/1000000);
+		if (left <= 0) {
+			warning("udev queue not empty after %us, continuing", timeout);
+			break;
+		}
+		/* the fd signals the queue becoming empty; recheck now and then
+		 * anyway in case an event got lost */
+		if (left > 250)
+			left = 250;
+		if (pfd.fd >= 0) {
+			if (poll(&pfd, 1, left) > 0)
+				udev_queue_flush(queue);
+		}
+		else
+			usleep(left*1000);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	debug("udev settled after %ld ms", (now.tv_sec-t0.tv_sec)*1000 +
+		  (now.tv_nsec-t0.tv_nsec)/1000000);
+	udev_queue_unref(queue);
+}
+
+typedef struct {
+	char *name;				/* /dev/... */
+	char *devpath;
+	int is_part;
+	int partn;				/* partition number, -1 if unknown */
+	int parent;				/* index of the disk for partitions, or -1 */
+	int removable;
+} cpdev_t;
+
+static int find_cpdev(cpdev_t *devs, unsigned n, const char *devpath,
+					  size_t len)
+{
+	unsigned i;
+
+	for(i = 0; i < n; ++i) {
+		if (!devs[i].is_part && strlen(devs[i].devpath) == len &&
+			strncmp(devs[i].devpath, devpath, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* devices are registered in parallel by this many threads at most */
+#define COLDPLUG_WORKERS	8
+
+typedef struct {
+	cpdev_t *devs;
+	unsigned n, next;
+	int parts;				/* phase: 0 = disks, 1 = partitions */
+	pthread_mutex_t lock;
+} cpqueue_t;
+
+static int cp_wanted(cpqueue_t *q, unsigned i)
+{
+	cpdev_t *d = &q->devs[i];
+
+	if (q->parts)
+		return d->is_part && d->parent >= 0 && q->devs[d->parent].removable;
+	return !d->is_part && d->removable;
+}
+
+static void *coldplug_worker(void *arg)
+{
+	cpqueue_t *q = arg;
+	unsigned i;
+
+	for(;;) {
+		pthread_mutex_lock(&q->lock);
+		while(q->next < q->n && !cp_wanted(q, q->next))
+			++q->next;
+		if (q->next >= q->n) {
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+		add_mount_with_devpath(q->devs[i].name, q->devs[i].devpath,
+							   q->devs[i].partn);
+	}
+}
+
+/* returns number of devices registered */
+static unsigned coldplug_phase(cpdev_t *devs, unsigned n, int parts)
+{
+	cpqueue_t q = { devs, n, 0, parts, PTHREAD_MUTEX_INITIALIZER };
+	pthread_t threads[COLDPLUG_WORKERS];
+	unsigned i, cnt = 0, n_threads = 0;
+
+	for(i = 0; i < n; ++i)
+		cnt += cp_wanted(&q, i);
+	while(n_threads < cnt && n_threads < COLDPLUG_WORKERS) {
+		if (pthread_create(&threads[n_threads], NULL, coldplug_worker, &q)) {
+			warning("failed to create coldplug thread");
+			break;
+		}
+		++n_threads;
+	}
+	if (!n_threads)
+		/* do it ourselves */
+		coldplug_worker(&q);
+	for(i = 0; i < n_threads; ++i)
+		pthread_join(threads[i], NULL);
+	return cnt;
+}
+
+/* replay events of already existing devices (at start time); the block
+ * subsystem is enumerated once and parents are registered before their
+ * partitions, so those find their parent right away */
 void coldplug(void)
 {
-	struct udev_enumerate *d_enum, *p_enum;
-	struct udev_list_entry *d_ent, *p_ent;
+	struct udev *udev = thread_udev();
+	struct udev_enumerate *d_enum;
+	struct udev_list_entry *d_ent;
+	cpdev_t *devs = NULL;
+	unsigned n = 0, i, cnt;
+	struct timespec t0, t1;
 
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 	if (!(d_enum = udev_enumerate_new(udev))) {
 		error("cannot create udev enumerator");
 		return;
 	}
 	udev_enumerate_add_match_subsystem(d_enum, "block");
-#if 0
-	/* The two busses seem to be OR-ed, which the sysattr AND-ed, so would
-	 * need two runs, yielding partially same results? For now it seems
-	 * sufficient to check the removable flag. */
-	udev_enumerate_add_match_property(d_enum, "ID_BUS", "usb");
-	udev_enumerate_add_match_property(d_enum, "ID_BUS", "ieee1394");
-#endif
-	udev_enumerate_add_match_sysattr(d_enum, "removable", "1");
 	udev_enumerate_scan_devices(d_enum);
 
 	udev_list_entry_foreach(d_ent, udev_enumerate_get_list_entry(d_enum)) {
 		struct udev_device *dev =
 			udev_device_new_from_syspath
 			(udev, udev_list_entry_get_name(d_ent));
+		const char *devtype, *rem;
+		char devname[PATH_MAX];
+
 		if (!dev)
 			continue;
-		if (!(p_enum = udev_enumerate_new(udev))) {
-			error("cannot create udev enumerator");
-			continue;
-		}
-		udev_enumerate_add_match_parent(p_enum, dev);
-		udev_enumerate_scan_devices(p_enum);
-		udev_list_entry_foreach(p_ent, udev_enumerate_get_list_entry(p_enum)) {
-				struct udev_device *part =
-					udev_device_new_from_syspath
-					(udev, udev_list_entry_get_name(p_ent));
-				if (!part)
-					continue;
-				char devname[PATH_MAX];
-				snprintf(devname, sizeof(devname), "/dev/%s",
-						 udev_device_get_sysname(part));
-				add_mount_with_devpath(devname,
-									   udev_device_get_devpath(part));
-				udev_device_unref(part);
-		}
-		udev_enumerate_unref(p_enum);
+		devtype = udev_device_get_devtype(dev);
+		devs = xrealloc(devs, (n+1)*sizeof(cpdev_t));
+		snprintf(devname, sizeof(devname), "/dev/%s",
+				 udev_device_get_sysname(dev));
+		devs[n].name = xstrdup(devname);
+		devs[n].devpath = xstrdup(udev_device_get_devpath(dev));
+		devs[n].parent = -1;
+		devs[n].is_part = devtype && streq(devtype, "partition");
+		devs[n].partn = -1;
+		if (!devs[n].is_part)
+			devs[n].partn = 0;
+		else if ((rem = udev_device_get_property_value(dev, "PARTN")))
+			devs[n].partn = atoi(rem);
+		/* partitions have no removable attribute, their disk counts */
+		rem = devs[n].is_part ? NULL :
+			  udev_device_get_sysattr_value(dev, "removable");
+		devs[n].removable = rem && streq(rem, "1");
+		++n;
 		udev_device_unref(dev);
 	}
 	udev_enumerate_unref(d_enum);
+
+	/* resolve partitions to their disks */
+	for(i = 0; i < n; ++i) {
+		const char *p;
+		if (devs[i].is_part && (p = strrchr(devs[i].devpath, '/')))
+			devs[i].parent = find_cpdev(devs, n, devs[i].devpath,
+										p - devs[i].devpath);
+	}
+
+	/* all disks first, then all partitions, each in parallel */
+	cnt = coldplug_phase(devs, n, 0);
+	cnt += coldplug_phase(devs, n, 1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	msg("coldplug registered %u devices in %ld ms", cnt,
+		(t1.tv_sec-t0.tv_sec)*1000 + (t1.tv_nsec-t0.tv_nsec)/1000000);
+
+	for(i = 0; i < n; ++i) {
+		free(devs[i].name);
+		free(devs[i].devpath);
+	}
+	free(devs);
 }
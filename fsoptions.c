@@ -33,8 +33,10 @@
 
 fsoptions_t *fsoptions = NULL;
 mntoptions_t *mntoptions = NULL;
+pollopt_t *pollopts = NULL;
 static pthread_mutex_t fsoptions_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t mntoptions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pollopts_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 static char *filter_options(const char *_opts)
@@ -114,6 +116,28 @@ void purge_fsoptions(void)
 	pthread_mutex_unlock(&fsoptions_lock);
 }
 
+/* forget the options from an /etc/fstab entry */
+void remove_fstab_fsoptions(const char *fsname)
+{
+	fsoptions_t **oo;
+
+	pthread_mutex_lock(&fsoptions_lock);
+	oo = &fsoptions;
+	while(*oo) {
+		fsoptions_t *o = *oo;
+		if (o->cond && o->cond->what == MWH_MTABDEVNAME &&
+			streq(o->cond->value, fsname)) {
+			*oo = o->next;
+			free_mcond(o->cond);
+			free((char*)o->options);
+			free(o);
+		}
+		else
+			oo = &(*oo)->next;
+	}
+	pthread_mutex_unlock(&fsoptions_lock);
+}
+
 void parse_mount_options(const char *_opts, int *iopts, const char **sopts)
 {
 	char opts[strlen(_opts)+1];
@@ -221,3 +245,52 @@ void purge_mntoptions(void)
 	pthread_mutex_unlock(&mntoptions_lock);
 }
 
+void add_pollopt(mcond_t *cond, long msecs)
+{
+	pollopt_t *o = xmalloc(sizeof(pollopt_t)), **oo;
+
+	o->cond = cond;
+	o->prio = mcond_prio(cond);
+	o->msecs = msecs;
+
+	pthread_mutex_lock(&pollopts_lock);
+	/* keep sorted by prio, append at end within same level */
+	for(oo = &pollopts; *oo; oo = &(*oo)->next)
+		if ((*oo)->prio > o->prio)
+			break;
+	o->next = *oo;
+	*oo = o;
+	pthread_mutex_unlock(&pollopts_lock);
+}
+
+/* returns 0 and the interval of the first matching poll-interval entry */
+int find_pollopt(mnt_t *m, long *msecs)
+{
+	pollopt_t *o;
+
+	pthread_mutex_lock(&pollopts_lock);
+	for(o = pollopts; o; o = o->next) {
+		if (match_mcond(o->cond, m, NULL)) {
+			*msecs = o->msecs;
+			pthread_mutex_unlock(&pollopts_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&pollopts_lock);
+	return -1;
+}
+
+void purge_pollopts(void)
+{
+	pollopt_t **oo;
+
+	pthread_mutex_lock(&pollopts_lock);
+	oo = &pollopts;
+	while(*oo) {
+		pollopt_t *o = *oo;
+		*oo = o->next;
+		free_mcond(o->cond);
+		free(o);
+	}
+	pthread_mutex_unlock(&pollopts_lock);
+}
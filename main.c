@@ -175,22 +175,26 @@ int main(int argc, char *argv[], char **env)
 	}
 	if (!(action = getenv("ACTION")))
 		fatal("Environment variable 'ACTION' not set");
-	if (!streq(action, "add") && !streq(action, "remove"))
-		fatal("ACTION must be 'add' or 'remove'");
+	if (!streq(action, "add") && !streq(action, "remove") &&
+		!streq(action, "change"))
+		fatal("ACTION must be 'add', 'remove', or 'change'");
 	if (!(devname = getenv("DEVNAME")))
 		fatal("Environment variable 'DEVNAME' not set");
 	
-	if (streq(action, "add")) {
+	if (streq(action, "add") || streq(action, "change")) {
 		unsigned i, n = 0;
 		const char *ids[MAX_IDS];
 
 		for(i = 0; env[i] && n < MAX_IDS-1; ++i) {
 			if (strprefix(env[i], "ID_") ||
-				strprefix(env[i], "DEVPATH="))
+				strprefix(env[i], "DISK_") ||
+				strprefix(env[i], "DEVPATH=") ||
+				strprefix(env[i], "DEVTYPE=") ||
+				strprefix(env[i], "PARTN="))
 				ids[n++] = env[i];
 		}
 		ids[n] = NULL;
-		send_cmd('+', devname, n, ids); 
+		send_cmd(streq(action, "add") ? '+' : '*', devname, n, ids); 
 	}
 	else {
 		send_cmd('-', devname, 0, NULL);
@@ -13,10 +13,18 @@
 #define SOCKLOCK			"/dev/.mediad.lock"
 #define ETC_FSTAB			"/etc/fstab"
 #define ETC_MTAB			"/etc/mtab"
+#define STATEDIR			"/var/lib/mediad"
+#define PROBE_CACHE			STATEDIR "/probe-cache"
+#define RUNDIR				"/run/mediad"
+#define STATEFILE			RUNDIR "/state"
 
 #define DEF_FSOPTIONS		"nosuid,nodev"
 #define DEF_AUTOFS_EXP_FREQ	2
 #define DEF_AUTOFS_TIMEOUT	4
+#define DEF_STARTUP_HOLD	15
+#define UDEV_SETTLE_TIMEOUT	10
+#define STATE_SAVE_INTERVAL	30
+#define SHUTDOWN_TIMEOUT	20
 #define MAX_IDS				128
 #define MAX_ALIASES			16
 
@@ -48,10 +56,14 @@ typedef enum {
 	CCS_NONE,
 	CCS_CDROM,
 	CCS_FLOPPY,
+	CCS_SCSI,
 } check_change_t;
 
 typedef enum {
 	MOPT_NO_AUTOMOUNT = 1,
+	MOPT_PREMOUNT = 2,
+	MOPT_MOUNT_SIBLINGS = 4,
+	MOPT_LAZY_PROBE = 8,
 } mntoption_flag_t;
 
 typedef struct _mcond {
@@ -75,6 +87,13 @@ typedef struct _mntoptions {
 	unsigned       options;
 } mntoptions_t;
 
+typedef struct _pollopt {
+	struct _pollopt *next;
+	mcond_t        *cond;
+	unsigned       prio;
+	long           msecs;
+} pollopt_t;
+
 typedef struct _alias {
 	struct _alias  *next;
 	mcond_t        *cond;
@@ -93,9 +112,26 @@ typedef struct _alist {
 #define AF_PERM   2
 #define AF_OLD    4
 
+typedef struct _autoroot {
+	struct _autoroot *next;
+	const char      *dir;
+	unsigned long   expire_timeout;
+	unsigned        max_workers;
+	int             pfd, ifd;
+	int             n_mounted;
+	unsigned        n_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t  expire_cond;
+	struct _rootpkt *pending;		/* requests waiting for a worker */
+	struct _rootpkt **pending_tail;
+	struct _adopted *adopted;
+} autoroot_t;
+
 typedef struct _mnt {
 	struct _mnt     *next;
 	struct _mnt     *parent;
+	struct _mnt     *hnext;			/* devpath hash chain */
+	autoroot_t      *root;
 	unsigned		n_children;
 	pthread_mutex_t lock;
 	const char      *dev;
@@ -115,13 +151,27 @@ typedef struct _mnt {
 	unsigned        suppress_message : 1;
 	unsigned        delayed_message : 1;
 	unsigned        no_automount : 1;
+	unsigned        mount_siblings : 1;
+	unsigned        uevent_changes : 1;
+	unsigned        diskseq_polled : 1;
+	unsigned        poll_msecs_set : 1;
+	unsigned        hashed : 1;
+	unsigned        lazy_probe : 1;		/* not probed until first access */
 	check_change_t  check_change_strategy;
 	int             check_change_param;
+	int             ctl_fd;			/* handle for change checks */
+	unsigned        ctl_sg : 1;		/* ctl_fd is the SCSI generic node */
+	long long       diskseq;
+	long long       size;			/* in sectors, at last probe */
+	long long       saved_poll_msecs;
 } mnt_t;
 
 typedef struct _config {
 	unsigned int  expire_freq;
 	unsigned long expire_timeout;
+	unsigned int  max_workers;
+	unsigned int  startup_hold;
+	unsigned int  reconnect_grace;
 	unsigned char blink_led;
 	unsigned debug            : 1;
 	unsigned no_scan_fstab    : 1;
@@ -153,6 +203,10 @@ typedef struct _mntent_list {
 static __inline__ int streq(const char *a, const char *b) {
 	return strcmp(a, b) == 0;
 }
+/* like streq(), but either may be NULL */
+static __inline__ int same_str(const char *a, const char *b) {
+	return a ? (b && streq(a, b)) : !b;
+}
 static __inline__ int strcaseeq(const char *a, const char *b) {
 	return strcasecmp(a, b) == 0;
 }
@@ -161,34 +215,59 @@ static __inline__ const char *strprefix(const char *a, const char *b) {
 }
 
 /* daemon.c */
-extern struct udev *udev;
 extern pthread_attr_t thread_detached;
 extern sigset_t termsigs;
 extern int volatile shutting_down;
 extern int used_sigs[];
-int do_mount(const char *name);
-int do_umount(const char *name);
-void add_mount_with_devpath(const char *devname, const char *devpath);
+int do_mount(autoroot_t *r, const char *name);
+int do_umount(autoroot_t *r, const char *name);
+void add_mount_with_devpath(const char *devname, const char *devpath,
+							int partn);
 int daemon_main(void);
 
 /* autofs.c */
 extern const char *autodir;
-void inc_mounted(void);
-void dec_mounted(void);
-void start_automount(const char *dir);
+extern autoroot_t *default_root;
+void inc_mounted(autoroot_t *r);
+void dec_mounted(autoroot_t *r);
+void add_rootopt(mcond_t *cond, const char *dir,
+				 unsigned long timeout, unsigned workers);
+void purge_rootopts(void);
+autoroot_t *find_root(mnt_t *m);
+autoroot_t *root_of_path(const char *path, const char **rest);
+void update_roots(void);
+void start_automount(void);
 void prepare_stop_automount(void);
-void stop_automount(const char *dir);
+void detach_automount(void);
+void stop_automount(void);
+int claim_adopted(autoroot_t *r, const char *name, const char *dev);
+void release_adopted(void);
+unsigned take_workers(autoroot_t *r, unsigned n);
+void put_worker(autoroot_t *r);
 
 /* changed.c */
 int no_medium_errno(void);
-int check_medium(const char *dev);
+int check_medium(mnt_t *m);
+void close_ctl_fd(mnt_t *m);
+void eject_medium(mnt_t *m);
 void check_medium_change(mnt_t *m);
+void finish_lazy_probe(mnt_t *m);
+int apply_change_event(mnt_t *m, unsigned n, char **ids);
+void record_diskseq(mnt_t *m);
+void set_media_polling(mnt_t *m);
+void restore_media_polling(mnt_t *m);
 void set_no_medium_present(mnt_t *m);
 
 /* udev.c */
 void get_dev_infos(mnt_t *m);
+void forget_dev_infos(const char *devpath);
+void probe_dev_infos(mnt_t *m, int fd);
 void find_devpath(mnt_t *m);
+struct udev *thread_udev(void);
+void index_fs_ids(mnt_t *m);
+void unindex_fs_ids(const char *dev);
 int find_by_property(const char *propname, const char *propval, char *outname, size_t outsize);
+void udev_settle(unsigned timeout);
 void coldplug(void);
 
 /* config.c */
@@ -205,10 +284,14 @@ int call_mount(const char *dev, const char *path,
 void add_fsoptions(mcond_t *cond, const char *opts);
 const char *find_fsoptions(mnt_t *m);
 void purge_fsoptions(void);
+void remove_fstab_fsoptions(const char *fsname);
 void parse_mount_options(const char *_opts, int *iopts, const char **sopts);
 void add_mntoptions(mcond_t *cond, unsigned options);
 unsigned find_mntoptions(mnt_t *m);
 void purge_mntoptions(void);
+void add_pollopt(mcond_t *cond, long msecs);
+int find_pollopt(mnt_t *m, long *msecs);
+void purge_pollopts(void);
 
 /* aliases.c */
 void add_alias(mcond_t *cond, const char *alias);
@@ -216,6 +299,7 @@ void purge_aliases(void);
 void match_aliases(mnt_t *m, int fsspec_only, unsigned flags);
 void mark_aliases(mnt_t *m, unsigned mask, unsigned flags, unsigned newflags);
 void mnt_add_alias(mnt_t *m, const char *a, unsigned flags);
+void mnt_rm_alias(mnt_t *m, const char *name);
 void mnt_free_aliases(mnt_t *m, unsigned mask, unsigned flags);
 void mk_aliases(mnt_t *m, whatalias_t fsspec);
 void rm_aliases(mnt_t *m, whatalias_t fsspec);
@@ -234,13 +318,27 @@ void add_mtab(const char *dev, const char *dir,
 			  const char *fstype, const char *options);
 void rm_mtab(const char *dir);
 
+/* state.c */
+void load_state(void);
+int state_keeps(const char *path);
+int restore_state(mnt_t *m, char **root);
+void release_state(void);
+void state_changed(void);
+int state_take_changed(void);
+FILE *state_create(void);
+void state_write(FILE *f, mnt_t *m);
+void state_write_poll(FILE *f, mnt_t *m);
+int state_saved_poll(mnt_t *m, long long *msecs);
+void state_close(FILE *f);
+void discard_state(void);
+
 /* util.c */
 void logit(int pri, const char *fmt, ...);
 void *xmalloc(size_t sz);
 void *xrealloc(void *p, size_t sz);
 char *xstrdup(const char *str);
 void xfree(const char **p);
-char *mkpath(char *buf, const char *add);
+char *mkpath(char *buf, const autoroot_t *r, const char *add);
 size_t is_name_eq_val(const char *str);
 const char *getid(unsigned n, const char **ids, const char *what);
 void parse_id(mnt_t *m, const char *line);
@@ -252,6 +350,9 @@ void send_str(int fd, const char *str);
 unsigned recv_num(int fd);
 void recv_str(int fd, char **p);
 unsigned int linux_version_code(void);
+int read_sysfs_str(const char *path, char *buf, size_t size);
+int read_sysfs_num(const char *path, long long *val);
+int write_sysfs_num(const char *path, long long val);
 void cgroup_set(const char *grp);
 void set_mnt_ns(pid_t pid);
 void set_comm(const char *c);
@@ -0,0 +1,464 @@
+/*
+ * mediad -- daemon to automount removable media
+ *
+ * Copyright (c) 2006-2021 by Roman Hodek <roman@hodek.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307  USA.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "mediad.h"
+
+/* The state snapshot lets a restarted daemon take over the devices of its
+ * predecessor without probing them again and without recreating their
+ * directories and alias symlinks. It's a text file with one line per device
+ * ("D"), each followed by lines for its aliases ("A"):
+ *
+ *   V <version> <mtime of config file>
+ *   D dev devpath root dir partition size diskseq medium_present
+ *     check_change_strategy check_change_param type uuid label vendor
+ *     model serial
+ *   A flags name created
+ *   P devpath msecs
+ *
+ * size and diskseq are the disk's (also for partitions) as recorded when
+ * the medium was last probed, so that any change since then makes the next
+ * instance probe again. P lines hold the original media poll interval of
+ * disks that mediad changed, so that it's restored on a real shutdown even
+ * after any number of restarts.
+ *
+ * Fields are separated by tabs, which can't occur in any of the values.
+ */
+#define STATE_VERSION	1
+
+typedef struct _sdev {
+	struct _sdev *next;
+	char *dev, *devpath, *root, *dir;
+	unsigned partition;
+	long long size, diskseq;
+	int medium_present;
+	int strategy, param;
+	char *type, *uuid, *label, *vendor, *model, *serial;
+	alist_t *aliases;
+} sdev_t;
+
+typedef struct _spoll {
+	struct _spoll *next;
+	char *devpath;
+	long long msecs;
+} spoll_t;
+
+static sdev_t *sdevs;
+static spoll_t *spolls;
+static int aliases_valid;
+static volatile int state_dirty;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+/* held from state_create() to state_close() */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *field(char **p)
+{
+	char *f = strsep(p, "\t\n");
+	return (f && *f) ? xstrdup(f) : NULL;
+}
+
+static long long numfield(char **p)
+{
+	char *f = strsep(p, "\t\n");
+	return f ? strtoll(f, NULL, 10) : -1;
+}
+
+static void free_salias(alist_t *a)
+{
+	free((char*)a->name);
+	free((char*)a->created);
+	free(a);
+}
+
+static void free_sdev(sdev_t *s)
+{
+	alist_t *a;
+
+	while((a = s->aliases)) {
+		s->aliases = a->next;
+		free_salias(a);
+	}
+	free(s->dev);
+	free(s->devpath);
+	free(s->root);
+	free(s->dir);
+	free(s->type);
+	free(s->uuid);
+	free(s->label);
+	free(s->vendor);
+	free(s->model);
+	free(s->serial);
+	free(s);
+}
+
+static long long config_mtime(void)
+{
+	struct stat st;
+
+	return stat(CONFIGFILE, &st) ? 0 : (long long)st.st_mtime;
+}
+
+/* read the snapshot of the previous instance, if any */
+void load_state(void)
+{
+	FILE *f;
+	char line[2048], *p;
+	sdev_t *s = NULL, **tail = &sdevs;
+	alist_t *a;
+	spoll_t *sp;
+	unsigned n = 0;
+
+	if (!(f = fopen(STATEFILE, "r")))
+		return;
+	if (!fgets(line, sizeof(line), f) || line[0] != 'V' ||
+		atoi(line+2) != STATE_VERSION) {
+		debug("ignoring " STATEFILE " of different version");
+		fclose(f);
+		return;
+	}
+	p = line+2;
+	strsep(&p, "\t");
+	/* aliases depend on the configuration */
+	aliases_valid = p && strtoll(p, NULL, 10) == config_mtime();
+
+	while(fgets(line, sizeof(line), f)) {
+		p = line+2;
+		if (line[0] == 'D' && line[1] == '\t') {
+			s = xmalloc(sizeof(sdev_t));
+			memset(s, 0, sizeof(*s));
+			s->dev = field(&p);
+			s->devpath = field(&p);
+			s->root = field(&p);
+			s->dir = field(&p);
+			s->partition = numfield(&p);
+			s->size = numfield(&p);
+			s->diskseq = numfield(&p);
+			s->medium_present = numfield(&p);
+			s->strategy = numfield(&p);
+			s->param = numfield(&p);
+			s->type = field(&p);
+			s->uuid = field(&p);
+			s->label = field(&p);
+			s->vendor = field(&p);
+			s->model = field(&p);
+			s->serial = field(&p);
+			if (!s->dev || !s->devpath || !s->root || !s->dir) {
+				free_sdev(s);
+				s = NULL;
+				continue;
+			}
+			*tail = s;
+			tail = &s->next;
+			++n;
+		}
+		else if (line[0] == 'A' && line[1] == '\t' && s) {
+			a = xmalloc(sizeof(alist_t));
+			a->flags = numfield(&p);
+			a->name = field(&p);
+			a->created = field(&p);
+			if (!a->name) {
+				free_salias(a);
+				continue;
+			}
+			a->next = s->aliases;
+			s->aliases = a;
+		}
+		else if (line[0] == 'P' && line[1] == '\t') {
+			sp = xmalloc(sizeof(spoll_t));
+			if (!(sp->devpath = field(&p))) {
+				free(sp);
+				continue;
+			}
+			sp->msecs = numfield(&p);
+			sp->next = spolls;
+			spolls = sp;
+		}
+	}
+	fclose(f);
+	debug("loaded state of %u devices from " STATEFILE "%s", n,
+		  aliases_valid ? "" : " (config changed, recreating aliases)");
+}
+
+/* does the snapshot still need this directory or symlink? */
+int state_keeps(const char *path)
+{
+	sdev_t *s;
+	alist_t *a;
+	const char *p;
+	int rv = 0;
+
+	pthread_mutex_lock(&state_lock);
+	for(s = sdevs; s && !rv; s = s->next) {
+		if ((p = strprefix(path, s->root)) && *p == '/' &&
+			streq(p+1, s->dir))
+			rv = 1;
+		for(a = s->aliases; a && !rv && aliases_valid; a = a->next) {
+			if (a->created && streq(a->created, path))
+				rv = 1;
+		}
+	}
+	pthread_mutex_unlock(&state_lock);
+	return rv;
+}
+
+/* current diskseq or size of the disk devpath is on */
+static long long disk_attr(const char *devpath, unsigned partition,
+						   const char *attr)
+{
+	char path[PATH_MAX], *p;
+	long long val;
+
+	snprintf(path, sizeof(path), "/sys%s", devpath);
+	if (partition && (p = strrchr(path, '/')))
+		*p = '\0';
+	snprintf(path+strlen(path), sizeof(path)-strlen(path), "/%s", attr);
+	return read_sysfs_num(path, &val) ? -1 : val;
+}
+
+static void set_field(const char **dst, const char *src)
+{
+	xfree(dst);
+	if (src)
+		*dst = xstrdup(src);
+}
+
+static void unlink_saliases(sdev_t *s)
+{
+	alist_t *a;
+
+	for(a = s->aliases; a; a = a->next) {
+		if (a->created)
+			unlink(a->created);
+	}
+}
+
+/* Take over what the previous instance knew about m, if m is still the
+ * same device with the same medium. Returns 1 in that case, 2 if its aliases
+ * could be taken over, too; *root is then the root directory the device was
+ * under. */
+int restore_state(mnt_t *m, char **root)
+{
+	sdev_t **ss, *s;
+	alist_t *a;
+	long long seq;
+	int rv;
+
+	pthread_mutex_lock(&state_lock);
+	for(ss = &sdevs; (s = *ss); ss = &s->next) {
+		if (streq(s->dev, m->dev)) {
+			*ss = s->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&state_lock);
+	if (!s)
+		return 0;
+
+	seq = disk_attr(s->devpath, s->partition, "diskseq");
+	if (!m->devpath || !streq(s->devpath, m->devpath) ||
+		!streq(s->dir, m->dir) || s->partition != m->partition ||
+		disk_attr(s->devpath, s->partition, "size") != s->size ||
+		seq != s->diskseq) {
+		debug("%s: changed since last snapshot", m->dev);
+		goto drop;
+	}
+	if (seq < 0 && m->partition) {
+		/* the medium may have been changed in between and the partition
+		 * is a different one now; probe it again */
+		debug("%s: no diskseq, probing again", m->dev);
+		goto drop;
+	}
+
+	set_field(&m->type, s->type);
+	set_field(&m->uuid, s->uuid);
+	set_field(&m->label, s->label);
+	set_field(&m->vendor, s->vendor);
+	set_field(&m->model, s->model);
+	set_field(&m->serial, s->serial);
+	m->medium_present = s->medium_present;
+	m->check_change_strategy = s->strategy;
+	m->check_change_param = s->param;
+	/* without a diskseq there's no telling whether the medium was changed
+	 * in between, so check on next access */
+	if (seq < 0)
+		m->medium_changed = 1;
+	rv = aliases_valid ? 2 : 1;
+	while(aliases_valid && (a = s->aliases)) {
+		s->aliases = a->next;
+		if (a->flags & AF_PERM) {
+			/* the fstab scan adds these again */
+			if (a->created)
+				unlink(a->created);
+			free_salias(a);
+			continue;
+		}
+		a->next = m->aliases;
+		m->aliases = a;
+	}
+	*root = s->root;
+	s->root = NULL;
+	free_sdev(s);
+	debug("%s: restored from snapshot", m->dev);
+	return rv;
+
+  drop:
+	if (aliases_valid)
+		unlink_saliases(s);
+	free_sdev(s);
+	return 0;
+}
+
+/* Get the media poll interval m had before the previous instance changed
+ * it. Returns 0 if there is one. */
+int state_saved_poll(mnt_t *m, long long *msecs)
+{
+	spoll_t **spp, *sp;
+
+	if (!m->devpath)
+		return -1;
+	pthread_mutex_lock(&state_lock);
+	for(spp = &spolls; (sp = *spp); spp = &sp->next) {
+		if (streq(sp->devpath, m->devpath)) {
+			*spp = sp->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&state_lock);
+	if (!sp)
+		return -1;
+	*msecs = sp->msecs;
+	free(sp->devpath);
+	free(sp);
+	return 0;
+}
+
+/* after coldplug: devices left in the snapshot are gone */
+void release_state(void)
+{
+	sdev_t *s;
+	spoll_t *sp;
+	char path[PATH_MAX];
+
+	pthread_mutex_lock(&state_lock);
+	while((sp = spolls)) {
+		spolls = sp->next;
+		free(sp->devpath);
+		free(sp);
+	}
+	while((s = sdevs)) {
+		sdevs = s->next;
+		if (aliases_valid)
+			unlink_saliases(s);
+		snprintf(path, sizeof(path), "%s/%s", s->root, s->dir);
+		/* mounted ones are handled by release_adopted() */
+		rmdir(path);
+		debug("%s from snapshot no longer present", s->dev);
+		free_sdev(s);
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+void state_changed(void)
+{
+	state_dirty = 1;
+}
+
+/* returns and clears the changed flag */
+int state_take_changed(void)
+{
+	int rv = state_dirty;
+
+	state_dirty = 0;
+	return rv;
+}
+
+FILE *state_create(void)
+{
+	FILE *f;
+
+	pthread_mutex_lock(&save_lock);
+	if (mkdir(RUNDIR, 0755) && errno != EEXIST) {
+		warning("mkdir(" RUNDIR "): %s", strerror(errno));
+		goto err;
+	}
+	if (!(f = fopen(STATEFILE ".new", "w"))) {
+		warning("cannot create " STATEFILE ".new: %s", strerror(errno));
+		goto err;
+	}
+	fprintf(f, "V %d\t%lld\n", STATE_VERSION, config_mtime());
+	return f;
+
+  err:
+	pthread_mutex_unlock(&save_lock);
+	return NULL;
+}
+
+#define S(x)	((x) ? (x) : "")
+
+void state_write(FILE *f, mnt_t *m)
+{
+	mnt_t *d = m->parent ? m->parent : m;
+	alist_t *a;
+
+	/* an unprobed device is just added again */
+	if (!m->devpath || m->lazy_probe)
+		return;
+	fprintf(f, "D\t%s\t%s\t%s\t%s\t%u\t%lld\t%lld\t%d\t%d\t%d\t%s\t%s\t%s\t%s\t%s\t%s\n",
+			m->dev, m->devpath, m->root->dir, m->dir, m->partition,
+			d->size, d->diskseq,
+			m->medium_present, m->check_change_strategy,
+			m->check_change_param,
+			S(m->type), S(m->uuid), S(m->label),
+			S(m->vendor), S(m->model), S(m->serial));
+	for(a = m->aliases; a; a = a->next)
+		fprintf(f, "A\t%u\t%s\t%s\n", a->flags, a->name, S(a->created));
+}
+
+/* unlike state_write(), also for busy and unprobed devices: the original
+ * value would be lost otherwise */
+void state_write_poll(FILE *f, mnt_t *m)
+{
+	if (m->poll_msecs_set && m->devpath)
+		fprintf(f, "P\t%s\t%lld\n", m->devpath, m->saved_poll_msecs);
+}
+
+void state_close(FILE *f)
+{
+	if (fclose(f) || rename(STATEFILE ".new", STATEFILE)) {
+		warning("cannot write " STATEFILE ": %s", strerror(errno));
+		unlink(STATEFILE ".new");
+	}
+	pthread_mutex_unlock(&save_lock);
+}
+
+/* on a real shutdown, nothing is left to take over */
+void discard_state(void)
+{
+	pthread_mutex_lock(&save_lock);
+	unlink(STATEFILE);
+	pthread_mutex_unlock(&save_lock);
+}
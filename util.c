@@ -82,11 +82,11 @@ void xfree(const char **p)
 }
 
 
-char *mkpath(char *buf, const char *add)
+char *mkpath(char *buf, const autoroot_t *r, const char *add)
 {
 	char *p;
 	
-	strcpy(buf, autodir);
+	strcpy(buf, r->dir);
 	strcat(buf, "/");
 	p = buf+strlen(buf);
 	if (add)
@@ -141,7 +141,7 @@ void mk_dir(mnt_t *m)
 {
 	char path[PATH_MAX];
 	
-	mkpath(path, m->dir);
+	mkpath(path, m->root, m->dir);
 	if (mkdir(path, 0755) && errno != EEXIST)
 		error("mkdir(%s): %s", path, strerror(errno));
 }
@@ -150,7 +150,7 @@ void rm_dir(mnt_t *m)
 {
 	char path[PATH_MAX];
 	
-	mkpath(path, m->dir);
+	mkpath(path, m->root, m->dir);
 	if (rmdir(path))
 		if (!shutting_down || errno != EACCES)
 			warning("rmdir(%s): %s", path, strerror(errno));
@@ -229,6 +229,48 @@ unsigned int linux_version_code(void)
 	return KERNEL_VERSION(p, q, r);
 }
 
+/* read a (short) sysfs attribute, without trailing newline */
+int read_sysfs_str(const char *path, char *buf, size_t size)
+{
+	int fd;
+	ssize_t n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	n = read(fd, buf, size-1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	while(n > 0 && buf[n-1] == '\n')
+		--n;
+	buf[n] = '\0';
+	return 0;
+}
+
+int read_sysfs_num(const char *path, long long *val)
+{
+	char buf[32], *end;
+
+	if (read_sysfs_str(path, buf, sizeof(buf)))
+		return -1;
+	*val = strtoll(buf, &end, 10);
+	return (end == buf) ? -1 : 0;
+}
+
+int write_sysfs_num(const char *path, long long val)
+{
+	char buf[32];
+	int fd, len, rv = 0;
+
+	if ((fd = open(path, O_WRONLY)) < 0)
+		return -1;
+	len = sprintf(buf, "%lld", val);
+	if (write(fd, buf, len) != len)
+		rv = -1;
+	close(fd);
+	return rv;
+}
+
 #define SYS_CGROUP_UNIFIED	"/sys/fs/cgroup/unified"
 #define SYS_CGROUP_LEGACY	"/sys/fs/cgroup/pids"
 